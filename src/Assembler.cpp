@@ -99,6 +99,14 @@ namespace basm
             readToken();
             return static_cast<uint16_t>( i );
         }
+        else if( current.type == LABEL ) // address of a data label
+        {
+            if( data_labels.count( current.text ) == 0 )
+                return compileError( "Undeclared data label '" + current.text + "'" );
+            uint16_t address = data_labels[ current.text ];
+            readToken();
+            return address;
+        }
         compileError( "Expected a value" );
         return 0;
     }
@@ -167,6 +175,35 @@ namespace basm
         return '?' ; // unknown character
     }
 
+    // parse a string literal, escape sequences replaced, and call readToken()
+    string Assembler::parseStringValue( void )
+    {
+        string s = current.text.substr( 1, current.text.length() - 2 ); // remove quotes
+        string value = "";
+        for( size_t i = 0; i < s.length(); i++ )
+        {
+            if( s[i] != '\\' or i + 1 == s.length() )
+            {
+                value += s[i];
+                continue;
+            }
+            char c = s[++i];
+            if     ( c == 'n' ) value += '\n';
+            else if( c == 't' ) value += '\t';
+            else if( c == '0' ) value += '\0';
+            else                value += c;     // \" \\ and any other char stand for themselves
+        }
+        readToken();
+        return value;
+    }
+
+    // true if the current token can be read by parseValue : a number or a data label
+    bool Assembler::isValue( void ) const
+    {
+        return current.type == DECIMAL_VALUE or current.type == HEXA_VALUE or current.type == BINARY_VALUE
+            or ( current.type == LABEL and data_labels.count( current.text ) == 1 );
+    }
+
     // curent token must be a ENDL, compileError and return false otherwise
     bool Assembler::readEndl( void )
     {
@@ -213,7 +250,7 @@ namespace basm
     bool Assembler::loadAndTokenize( string fileName )
     {
 
-        char line[120];    // char * used to store line
+        string line;    // data directives make long lines
         std::ifstream rfile;    
         rfile.open( fileName );    // Open file
         if( rfile.is_open())
@@ -221,7 +258,7 @@ namespace basm
             token first_token(";", ENDL);  // used for error message in case or error on line 1
             tokens.push_back( first_token );
 
-            while(rfile.getline( line, 120 ))    // tokenize whole line for every lines
+            while( std::getline( rfile, line ))    // tokenize whole line for every lines
             {
                 tokenizeOneLine( line );
             }
@@ -244,6 +281,8 @@ namespace basm
     bool Assembler::assemble( string fileName )
     {
         rsp = 0;                     // instruction count, used for LABEL_DECL
+        size_t slash = fileName.find_last_of( '/' );
+        source_dir = ( slash == string::npos ) ? "" : fileName.substr( 0, slash + 1 );
         if( !loadAndTokenize( fileName )) // error while tokenizing
             return false;
 
@@ -279,7 +318,22 @@ namespace basm
             if( declared_labels.count( current.text ) == 1 ) 
                 return compileError("Label '" + labelStr + "' already defined" );
 
-            declared_labels.insert( std::pair<string, uint16_t>( labelStr, rsp ));    
+            if( declared_labels.count( labelStr ) == 1 or data_labels.count( labelStr ) == 1 )
+                return compileError("Label '" + labelStr + "' already defined" );
+
+            // a label followed by .word, .string or .zero names data, not an instruction
+            uint64_t next = j + 1;
+            while( tokens[ next ].type == ENDL )
+                next++;
+            string directive = lexer::to_lower( tokens[ next ].text );
+            if( tokens[ next ].type == DIRECTIVE and ( directive == ".word" or directive == ".string" or directive == ".zero" ))
+            {
+                data_labels.insert( std::pair<string, uint16_t>( labelStr, static_cast<uint16_t>( data_cursor )));
+                readToken();
+                return true;
+            }
+
+            declared_labels.insert( std::pair<string, uint32_t>( labelStr, rsp ));    
             // for debugging purposes:
             // cout << labelStr << ": " << rsp << endl;
             readToken();
@@ -287,17 +341,24 @@ namespace basm
         }    
         else if( current.type == STOP )
         {
+            relaxBranches();  // label addresses depend on the size of the branches
             j = 0;            // reset cursor
             rsp = 0;
+            data_cursor = DEFAULT_DATA_ADDRESS;
             current = tokens[ j ];
             return false;    // stop
         }
         else if( current.type == OP )
         {
+            string op = lexer::to_lower( current.text );
+            if(( op == "jump" or op == "call" ) and tokens[ j + 1 ].type == LABEL )
+                branches.push_back( Branch{ rsp, tokens[ j + 1 ].text } );
             readToken();
             rsp++;
             return true;
         }
+        else if( current.type == DIRECTIVE )
+            return layoutDirective();
         else
         {
             readToken();
@@ -306,6 +367,74 @@ namespace basm
         return false; // avoid warnings
     }
 
+    // choose the short or the far form of every branch, then turn label indexes into addresses
+    // a short branch can only reach the 64K segment of the next instruction, branches are made far
+    // until every one of them reaches its target : sizes only grow, so this always ends
+    void Assembler::relaxBranches( void )
+    {
+        far_branches.assign( rsp + 1, false );   // every instruction, plus the final halt
+        vector<uint32_t> address( rsp + 1, 0 );   // word address by instruction index
+
+        bool changed = true;
+        while( changed )
+        {
+            uint32_t a = 0;
+            for( uint64_t i = 0; i <= rsp; i++ )
+            {
+                address[i] = a;
+                a += far_branches[i] ? 2u : 1u;
+            }
+
+            changed = false;
+            for( const Branch& b : branches )
+            {
+                if( far_branches[b.index] or declared_labels.count( b.label ) == 0 )
+                    continue;
+                uint32_t target = address[ declared_labels[b.label] ];
+                if(( address[b.index] + 1 ) >> 16 != target >> 16 )
+                {
+                    far_branches[b.index] = true;
+                    changed = true;
+                }
+            }
+        }
+
+        for( auto& label : declared_labels )
+            label.second = address[ label.second ];
+    }
+
+    // push a jump or a call in its short form, or in its far form followed by the 32 bits target
+    bool Assembler::emitBranch( uint32_t instruction, uint32_t address )
+    {
+        if( not far_branches[rsp - 1] )
+        {
+            program.push_back( instruction | ( address & 0x0000FFFF ));
+            return true;
+        }
+
+        uint32_t mode = ( instruction & 0x0F000000 ) >> 24;   // same modes as the short form
+        uint32_t sign = ( instruction & 0x00F00000 ) >> 20;
+        uint32_t flag = ( instruction & 0x000F0000 ) >> 16;
+        program.push_back( 0x0B000000 | ( mode << 20 ) | ( flag << 16 ) | sign ); // FAR selector
+        program.push_back( address );
+        return true;
+    }
+
+    // address of a label used by an instruction encoding a 16 bits target, compileError if it does not fit
+    uint16_t Assembler::readShortLabel( const string& instr )
+    {
+        if( current.type != LABEL )
+            return compileError("Expected a label after " + instr + " instruction");
+        if( declared_labels.count( current.text ) == 0 )
+            return compileError("Undeclared label");
+
+        uint32_t address = declared_labels[ current.text ];
+        if( address > 0xFFFF )
+            return compileError("Label '" + current.text + "' used by " + instr + " must be in the first 65536 instructions");
+        readToken();
+        return static_cast<uint16_t>( address );
+    }
+
     // parse one instruction from the token array
     bool Assembler::parseOneInstr( void )
     {
@@ -326,8 +455,12 @@ namespace basm
         else if( current.type == LABEL_DECL ) // skip, already parsed by parseLabelDecl()
         {
             readToken();
+            if( current.type == DIRECTIVE ) // data label, ex: :MSG .string "Hello"
+                return parseDirective();
             return true;
         }
+        else if( current.type == DIRECTIVE )
+            return parseDirective();
         else if( current.type == OP )
         {
             string op = lexer::to_lower( current.text );
@@ -353,6 +486,30 @@ namespace basm
                 return parseJumpBasedInstr();
             else if( op == "cls" )
                 return parseCLSInstr();
+            else if( op == "native" or op == "syscall" )
+                return parseNativeInstr();
+            else if( op == "alloc" or op == "free" )
+                return parseHeapInstr();
+            else if( op == "cycles" or op == "clock" or op == "mark" )
+                return parseProfileInstr();
+            else if( op == "spawn" or op == "join" or op == "fence" )
+                return parseThreadInstr();
+            else if( op == "xadd" or op == "xchg" or op == "cas" )
+                return parseAtomicInstr();
+            else if( op == "send" or op == "recv" or op == "trysend" or op == "tryrecv" or op == "sendm" or op == "recvm" )
+                return parseChannelInstr();
+            else if( op == "pfor" )
+                return parsePforInstr();
+            else if( op == "ivec" or op == "timer" or op == "iret" or op == "idle" or op == "sti" or op == "cli" )
+                return parseInterruptInstr();
+            else if( op == "bank" )
+                return parseBankInstr();
+            else if( op == "present" )
+            {
+                readToken();
+                program.push_back( 0x0C000000 ); // PRESENT selector
+                return true;
+            }
             else if( op == "exit" )
             {
                 readToken();
@@ -474,7 +631,7 @@ namespace basm
             instruction |= l_offset << 0;
             l_mode = 3;
         } // branch on immediate value as left operand ex:    add 123, cx
-        else if( current.type == DECIMAL_VALUE or current.type == HEXA_VALUE or current.type == BINARY_VALUE )
+        else if( isValue() )
         {
             uint16_t imm_value = parseValue();
             readComma();
@@ -551,7 +708,7 @@ namespace basm
             l_mode = 2;
             instruction |= static_cast<uint32_t>( l_reg << 12 );
         }
-        else if( current.type == DECIMAL_VALUE or current.type == HEXA_VALUE or current.type == BINARY_VALUE )
+        else if( isValue() )
         {
             uint16_t imm_value = parseValue();
             instruction |= imm_value;                // add immediate value to the last 4 bits
@@ -584,7 +741,7 @@ namespace basm
     {
         uint32_t instruction = 0x90000000;
         readToken(); // skip push token
-        if( current.type == DECIMAL_VALUE or current.type == HEXA_VALUE or current.type == BINARY_VALUE )
+        if( isValue() )
         {
             uint16_t v = parseValue();
             instruction |= v;
@@ -651,9 +808,7 @@ namespace basm
             {
                 if( declared_labels.count( current.text ) == 1 ) // the label has been declared
                 {
-                    uint16_t address = declared_labels[ current.text ]; // get the instruction address
-
-                    instruction |= address;
+                    uint32_t address = declared_labels[ current.text ]; // get the instruction address
                     readToken();
 
                     if( current.type == ENDL ) // avoid being catched by else statement
@@ -682,8 +837,7 @@ namespace basm
                     else
                         return compileError("Unexpected token");
 
-                    program.push_back( instruction );
-                    return true;
+                    return emitBranch( instruction, address );
                 }    
                 else
                     return compileError("Undeclared label");
@@ -698,9 +852,8 @@ namespace basm
                 if( declared_labels.count( current.text ) == 1 ) // the label has been declared
                 {
 
-                    uint16_t address = declared_labels[ current.text ]; // get the instruction address
+                    uint32_t address = declared_labels[ current.text ]; // get the instruction address
                     instruction = 0xB0000000;
-                    instruction |= address;
 
                     readToken();   
 
@@ -729,8 +882,7 @@ namespace basm
                     else
                         return compileError("Unexpected token");
                     // return true in both case ( conditionnal or unconditionnal )
-                    program.push_back( instruction );
-                    return true;
+                    return emitBranch( instruction, address );
                 }
                 else
                     return compileError("Undeclared label");
@@ -812,8 +964,7 @@ namespace basm
             instruction |= static_cast<uint32_t>( reg << 4 );
             instruction |= offset;
         }
-        else if( current.type == DECIMAL_VALUE or current.type == HEXA_VALUE 
-            or current.type == BINARY_VALUE )
+        else if( isValue() )
         {
             uint16_t val = parseValue();
             readComma();
@@ -1035,6 +1186,425 @@ namespace basm
         return true;
     }
 
-}
+    // opcode 0, NATIVE ( alias SYSCALL ), the slot is resolved at assembly time
+    bool Assembler::parseNativeInstr( void )
+    {
+        readToken(); // read NATIVE token
+        uint32_t instruction = 0x02000000; // NATIVE selector
+
+        if( not isValue() )
+            return compileError("Expected a native slot number after native instruction");
+        string slot_text = current.text;
+        uint16_t slot = parseValue();   // native slot
+        if( slot > 255 )
+            return compileError("Native slot '" + slot_text + "' out of range, slots range is [0-255]");
+        instruction |= slot;
+
+        program.push_back( instruction );
+        return true;
+    }
+
+    // opcode 0, ALLOC size, reg  |  FREE reg
+    bool Assembler::parseHeapInstr( void )
+    {
+        uint32_t instruction = 0x03000000; // HEAP selector
+        string op = lexer::to_lower( current.text );
+        readToken(); // read ALLOC or FREE token
+
+        if( op == "alloc" )
+        {
+            if( current.type == REG )   // size from a register
+            {
+                uint8_t src = getRegInd( current.text );
+                readToken();
+                instruction |= 0x00100000;
+                instruction |= static_cast<uint32_t>( src << 4 );
+            }
+            else if( isValue() )
+                instruction |= parseValue();
+            else
+                return compileError("Expected a size, either a register or an immediate value");
+
+            readComma();
+        }
+        else // free
+            instruction |= 0x00200000;
+
+        if( current.type != REG )
+            return compileError("Expected a register holding the block address");
+        uint8_t dest = getRegInd( current.text );
+        instruction |= static_cast<uint32_t>( dest << 16 );
+        readToken();
+
+        program.push_back( instruction );
+        return true;
+    }
+
+    // opcode 0, CYCLES high, low  |  CLOCK high, low  |  MARK begin N  |  MARK end N
+    bool Assembler::parseProfileInstr( void )
+    {
+        uint32_t instruction = 0x04000000; // PROFILE selector
+        string op = lexer::to_lower( current.text );
+        readToken(); // read instruction token
+
+        if( op == "mark" )
+        {
+            string edge = lexer::to_lower( current.text );
+            if( edge == "begin" )
+                instruction |= 0x00200000;
+            else if( edge == "end" )
+                instruction |= 0x00300000;
+            else
+                return compileError("Expected 'begin' or 'end' after mark instruction");
+            readToken();
+
+            uint16_t region = parseValue();
+            if( region > 255 )
+                return compileError("Region number must be in range [0, 255]");
+            instruction |= region;
+        }
+        else // cycles or clock, the 32 bits value is split in two registers
+        {
+            if( op == "clock" )
+                instruction |= 0x00100000;
+
+            if( current.type != REG )
+                return compileError("Expected a register for the high word");
+            instruction |= static_cast<uint32_t>( getRegInd( current.text ) << 16 );
+            readToken();
+            readComma();
+
+            if( current.type != REG )
+                return compileError("Expected a register for the low word");
+            instruction |= static_cast<uint32_t>( getRegInd( current.text ) << 12 );
+            readToken();
+        }
+
+        program.push_back( instruction );
+        return true;
+    }
+
+    // opcode 0, SPAWN label, reg  |  JOIN reg  |  FENCE
+    bool Assembler::parseThreadInstr( void )
+    {
+        uint32_t instruction = 0x05000000; // THREAD selector
+        string op = lexer::to_lower( current.text );
+        readToken(); // read instruction token
+
+        if( op == "fence" )
+        {
+            instruction |= 0x00200000;
+            program.push_back( instruction );
+            return true;
+        }
+
+        if( op == "spawn" )
+        {
+            instruction |= readShortLabel( op ); // entry point
+            readComma();
+        }
+        else // join
+            instruction |= 0x00100000;
+
+        if( current.type != REG )
+            return compileError("Expected a register holding the thread stack address or id");
+        instruction |= static_cast<uint32_t>( getRegInd( current.text ) << 16 );
+        readToken();
+
+        program.push_back( instruction );
+        return true;
+    }
+
+    // opcode 0, XADD reg, (reg)  |  XCHG reg, (reg)  |  CAS expected, desired, (reg)
+    bool Assembler::parseAtomicInstr( void )
+    {
+        uint32_t instruction = 0x06000000; // ATOMIC selector
+        string op = lexer::to_lower( current.text );
+        readToken(); // read instruction token
 
+        if     ( op == "xchg" ) instruction |= 0x00100000;
+        else if( op == "cas" )  instruction |= 0x00200000;
+
+        if( current.type != REG )
+            return compileError("Expected a register as first operand");
+        instruction |= static_cast<uint32_t>( getRegInd( current.text ) << 16 );
+        readToken();
+        readComma();
+
+        if( op == "cas" ) // value stored if the exchange succeeds
+        {
+            if( current.type != REG )
+                return compileError("Expected a register holding the desired value");
+            instruction |= static_cast<uint32_t>( getRegInd( current.text ) << 12 );
+            readToken();
+            readComma();
+        }
+
+        if( not checkForDereferencement() )
+            return compileError("Atomic instructions only operate on a dereferenced register");
+        uint8_t offset = 0;
+        uint8_t reg = 0;
+        readDereferencedReg( offset, reg );
+        instruction |= static_cast<uint32_t>( reg << 4 );
+        instruction |= offset;
+
+        program.push_back( instruction );
+        return true;
+    }
+
+    // opcode 0, SEND reg, N  |  RECV reg, N  |  TRYSEND reg, N  |  TRYRECV reg, N
+    //           SENDM address, count, N  |  RECVM address, count, N
+    bool Assembler::parseChannelInstr( void )
+    {
+        uint32_t instruction = 0x07000000; // CHANNEL selector
+        string op = lexer::to_lower( current.text );
+        readToken(); // read instruction token
+
+        if     ( op == "recv" )    instruction |= 0x00100000;
+        else if( op == "trysend" ) instruction |= 0x00200000;
+        else if( op == "tryrecv" ) instruction |= 0x00300000;
+        else if( op == "sendm" )   instruction |= 0x00400000;
+        else if( op == "recvm" )   instruction |= 0x00500000;
+
+        if( current.type != REG )
+            return compileError("Expected a register as first operand");
+        instruction |= static_cast<uint32_t>( getRegInd( current.text ) << 12 );
+        readToken();
+        readComma();
+
+        if( op == "sendm" or op == "recvm" ) // block size
+        {
+            if( current.type != REG )
+                return compileError("Expected a register holding the block size");
+            instruction |= static_cast<uint32_t>( getRegInd( current.text ) << 8 );
+            readToken();
+            readComma();
+        }
+
+        uint16_t number = parseValue();
+        if( number > 15 )
+            return compileError("Channel number must be in range [0, 15]");
+        instruction |= static_cast<uint32_t>( number << 16 );
+
+        program.push_back( instruction );
+        return true;
+    }
+
+    // opcode 0, PFOR label, index, end   ->   call label for index in [index, end[
+    bool Assembler::parsePforInstr( void )
+    {
+        uint32_t instruction = 0x08000000; // PFOR selector
+        readToken(); // read PFOR token
+
+        instruction |= readShortLabel( "pfor" ); // routine address
+        readComma();
+
+        if( current.type != REG )
+            return compileError("Expected the register receiving the index");
+        instruction |= static_cast<uint32_t>( getRegInd( current.text ) << 20 );
+        readToken();
+        readComma();
+
+        if( current.type != REG )
+            return compileError("Expected the register holding the end of the range");
+        instruction |= static_cast<uint32_t>( getRegInd( current.text ) << 16 );
+        readToken();
+
+        program.push_back( instruction );
+        return true;
+    }
+
+    // opcode 0, IVEC N, label  |  TIMER value, unit  |  IRET  |  IDLE  |  STI  |  CLI
+    bool Assembler::parseInterruptInstr( void )
+    {
+        uint32_t instruction = 0x09000000; // INTERRUPT selector
+        string op = lexer::to_lower( current.text );
+        readToken(); // read instruction token
+
+        if( op == "ivec" )
+        {
+            uint16_t vector = parseValue();
+            if( vector > 15 )
+                return compileError("Interrupt vector must be in range [0, 15]");
+            instruction |= static_cast<uint32_t>( vector << 16 );
+            readComma();
+
+            instruction |= readShortLabel( op ); // handler address
+        }
+        else if( op == "timer" ) // same operands as wait
+        {
+            instruction |= 0x00100000;
+            instruction |= parseValue();
+            readComma();
+            if( current.type != TIME )
+                return compileError("Expected time units, either 's', 'ms' or 'us'");
+            if     ( current.text == "ms" ) instruction |= 0x00010000;
+            else if( current.text == "us" ) instruction |= 0x00020000;
+            readToken();
+        }
+        else if( op == "iret" ) instruction |= 0x00200000;
+        else if( op == "idle" ) instruction |= 0x00300000;
+        else if( op == "sti" )  instruction |= 0x00400000;
+        else if( op == "cli" )  instruction |= 0x00500000;
+
+        program.push_back( instruction );
+        return true;
+    }
+
+    // opcode 0, BANK window, bank   ->   bank is a register or an immediate value
+    bool Assembler::parseBankInstr( void )
+    {
+        uint32_t instruction = 0x0A000000; // BANK selector
+        readToken(); // read BANK token
+
+        uint16_t window = parseValue();
+        if( window > 15 )
+            return compileError("Window must be in range [0, 15]");
+        instruction |= static_cast<uint32_t>( window << 16 );
+        readComma();
+
+        if( current.type == REG )
+        {
+            instruction |= 0x00200000;
+            instruction |= static_cast<uint32_t>( getRegInd( current.text ) << 4 );
+            readToken();
+        }
+        else if( isValue() )
+            instruction |= parseValue();
+        else
+            return compileError("Expected a bank, either a register or an immediate value");
+
+        program.push_back( instruction );
+        return true;
+    }
+
+    // .map path, address ( , rw )   ->   map a host file in the guest memory at load time, read-only by default
+    bool Assembler::parseDirective( void )
+    {
+        string directive = lexer::to_lower( current.text );
+        readToken(); // read directive token
+
+        if( directive == ".map" )
+        {
+            if( current.type == ENDL or current.type == COMMA )
+                return compileError("Expected a file path after .map");
+            FileMap map{ current.text, 0, false };
+            if( map.path[0] != '/' )
+                map.path = source_dir + map.path; // relative to the assembled file
+            readToken();
+            readComma();
+
+            map.address = parseValue();
+            if( current.type == COMMA )
+            {
+                readComma();
+                string access = lexer::to_lower( current.text );
+                if( access == "rw" )
+                    map.writable = true;
+                else if( access != "ro" )
+                    return compileError("Expected 'ro' or 'rw' access");
+                readToken();
+            }
+            file_maps.push_back( map );
+            return true;
+        }
+        else if( directive == ".framebuffer" ) // .framebuffer address, width, height[, rate]
+        {
+            framebuffer.enabled = true;
+            framebuffer.address = parseValue();
+            readComma();
+            framebuffer.width = parseValue();
+            readComma();
+            framebuffer.height = parseValue();
+            if( current.type == COMMA )
+            {
+                readComma();
+                framebuffer.rate = parseValue();
+            }
+            return true;
+        }
+        else if( directive == ".data" )    // .data address : following data goes from address
+        {
+            data_cursor = parseValue();
+            return true;
+        }
+        else if( directive == ".word" )    // .word value, 'c', label, ...
+        {
+            while( true )
+            {
+                if( current.type == CHAR_VALUE )
+                    emitData( static_cast<uint16_t>( parseCharValue() ));
+                else if( isValue() )
+                    emitData( parseValue() );
+                else
+                    return compileError("Expected a value, a char or a data label");
+                if( current.type != COMMA )
+                    return true;
+                readComma();
+            }
+        }
+        else if( directive == ".string" )  // .string "text" : one char per word, then 0
+        {
+            if( current.type != STRING_VALUE )
+                return compileError("Expected a string after .string");
+            for( char c : parseStringValue() )
+                emitData( static_cast<uint8_t>( c ));
+            return emitData( 0 );
+        }
+        else if( directive == ".zero" )    // .zero count : count words set to 0
+        {
+            data_cursor += parseValue();   // the memory starts zeroed
+            return true;
+        }
+        return compileError("Unknown directive '" + directive + "'");
+    }
+
+    // first pass over a directive : move the data cursor, so that data labels get their address
+    bool Assembler::layoutDirective( void )
+    {
+        string directive = lexer::to_lower( current.text );
+        readToken(); // read directive token
+
+        if( directive == ".data" )
+            data_cursor = parseValue();
+        else if( directive == ".zero" )
+            data_cursor += parseValue();
+        else if( directive == ".string" and current.type == STRING_VALUE )
+            data_cursor += parseStringValue().length() + 1;
+        else if( directive == ".word" ) // one word per value, labels may not be declared yet
+        {
+            for( ; current.type != ENDL and current.type != STOP; readToken() )
+                if( current.type != COMMA )
+                    data_cursor++;
+        }
+        if( data_cursor > 0x10000 )
+            return compileError("Data does not fit in the memory");
+
+        while( current.type != ENDL and current.type != STOP ) // the second pass checks the syntax
+            readToken();
+        return true;
+    }
+
+    // write one word of data at the data cursor
+    bool Assembler::emitData( uint16_t word )
+    {
+        if( data_cursor > 0xFFFF )
+            return compileError("Data does not fit in the memory");
+
+        uint16_t address = static_cast<uint16_t>( data_cursor++ );
+        if( data.words.empty() )
+            data.base = address;
+        if( address < data.base ) // data declared below the image, grow it downward
+        {
+            data.words.insert( data.words.begin(), static_cast<size_t>( data.base - address ), 0 );
+            data.base = address;
+        }
+        size_t offset = static_cast<size_t>( address - data.base );
+        if( offset >= data.words.size() )
+            data.words.resize( offset + 1, 0 );
+        data.words[ offset ] = word;
+        return true;
+    }
+
+}
 
@@ -20,18 +20,56 @@ using lexer::token;
 namespace basm   // keep things contained in a namespace.  basm = Basal Assembly
 {
 
+    struct FileMap      // host file to map in the guest memory at load time, see .map directive
+    {
+        string   path;
+        uint16_t address;
+        bool     writable;
+    };
+
+    struct FramebufferConfig    // memory region shown as characters, see .framebuffer directive
+    {
+        bool     enabled = false;
+        uint16_t address = 0;
+        uint16_t width   = 0;
+        uint16_t height  = 0;
+        uint16_t rate    = 0;           // presentations per second, 0 : only by PRESENT
+    };
+
+    struct MemoryImage  // initialized memory written by .word and .string, copied by VM::load
+    {
+        uint16_t         base = 0;         // address of the first word
+        vector<uint16_t> words;
+    };
+
     class Assembler
     {
     public:
         vector<uint32_t> program;          // store all the instructions
+        vector<FileMap>  file_maps;        // files to map before starting the program
+        MemoryImage      data;             // initialized memory
+        FramebufferConfig framebuffer;     // framebuffer to configure before starting the program
+
+        static const uint16_t DEFAULT_DATA_ADDRESS = 0x8000;   // where data goes until a .data directive
 
     private:
         uint64_t rsp{ 0 };                      // increment every time an instruction is parsed, used to map labels to program address
         uint64_t j{ 0 };                        // used to count tokens
         uint64_t lineNbr{ 0 };                  // one empty line is always artifially added at the begining
         vector<token> tokens;                   // store all tokens
-        map<string, uint16_t> declared_labels;  // store addresses of labels
+        map<string, uint32_t> declared_labels;  // store addresses of labels
         token current;                          // used as current token
+        string source_dir;                      // directory of the assembled file, base of relative paths
+
+        struct Branch                           // jump or call to a label, found by the first pass
+        {
+            uint64_t index;                     // instruction index of the branch
+            string   label;                     // target
+        };
+        vector<Branch> branches;
+        vector<bool>   far_branches;            // by instruction index : use the two words far form
+        map<string, uint16_t> data_labels;      // addresses of labels declared before .word, .string or .zero
+        uint32_t data_cursor{ DEFAULT_DATA_ADDRESS };   // address of the next data word
 
     public:
         // assemble instructions
@@ -50,6 +88,12 @@ namespace basm   // keep things contained in a namespace.  basm = Basal Assembly
         // parse characters
         char parseCharValue( void );
 
+        // parse a string literal, escape sequences replaced
+        string parseStringValue( void );
+
+        // true if the current token can be read by parseValue : a number or a data label
+        bool isValue( void ) const;
+
         // check if nexts tokens can be interpreted as a dereferencement
         bool checkForDereferencement( void ) const;
 
@@ -71,6 +115,15 @@ namespace basm   // keep things contained in a namespace.  basm = Basal Assembly
         // parse label declarations
         bool parseLabelDecl( void );
 
+        // choose the short or the far form of every branch, then turn label indexes into addresses
+        void relaxBranches( void );
+
+        // push a jump or a call in its short form, or in its far form followed by the 32 bits target
+        bool emitBranch( uint32_t instruction, uint32_t address );
+
+        // address of a label used by an instruction encoding a 16 bits target, compileError if it does not fit
+        uint16_t readShortLabel( const string& instr );
+
         // look at a token and redirect toward the appropriatre function, eg : ADD -> call parseAddBasedInstr()     
         bool parseOneInstr( void );
 
@@ -107,5 +160,41 @@ namespace basm   // keep things contained in a namespace.  basm = Basal Assembly
         // opcode 0, CLS
         bool parseCLSInstr( void );
 
+        // opcode 0, NATIVE ( alias SYSCALL )
+        bool parseNativeInstr( void );
+
+        // opcode 0, ALLOC, FREE
+        bool parseHeapInstr( void );
+
+        // opcode 0, CYCLES, CLOCK, MARK
+        bool parseProfileInstr( void );
+
+        // opcode 0, SPAWN, JOIN, FENCE
+        bool parseThreadInstr( void );
+
+        // opcode 0, XADD, XCHG, CAS
+        bool parseAtomicInstr( void );
+
+        // opcode 0, SEND, RECV, TRYSEND, TRYRECV, SENDM, RECVM
+        bool parseChannelInstr( void );
+
+        // opcode 0, PFOR
+        bool parsePforInstr( void );
+
+        // opcode 0, IVEC, TIMER, IRET, IDLE, STI, CLI
+        bool parseInterruptInstr( void );
+
+        // opcode 0, BANK
+        bool parseBankInstr( void );
+
+        // directives, they do not produce instructions
+        bool parseDirective( void );
+
+        // first pass over a directive : move the data cursor, so that data labels get their address
+        bool layoutDirective( void );
+
+        // write one word of data at the data cursor
+        bool emitData( uint16_t word );
+
     };
 }
@@ -0,0 +1,198 @@
+#include <thread>
+#include <bit>
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Channel.h"
+
+
+// spin a few times on the CPU, then give the hand back to the OS scheduler a few times
+// false once the budget is used up, the caller parks
+static bool backoff( unsigned& spins )
+{
+    if( ++spins < 64 )
+        std::atomic_signal_fence( std::memory_order_seq_cst ); // cheap busy wait
+    else if( spins < 128 )
+        std::this_thread::yield();
+    else
+        return false;
+    return true;
+}
+
+// the barrier between a value or a slot released and the read of 'parked' is paid by the thread
+// about to park, with membarrier, instead of by every send and receive. False if the kernel
+// does not support it, both sides use a full fence then
+static bool registerBarrier( void )
+{
+    return syscall( SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0 ) == 0;
+}
+
+static const bool asymmetric_barrier = registerBarrier();
+
+// side of wake() : a compiler barrier when the parking thread does the work
+static inline void lightBarrier( void )
+{
+    if( asymmetric_barrier )
+        std::atomic_signal_fence( std::memory_order_seq_cst );
+    else
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+}
+
+// side of park() : a full barrier on every thread of the process running right now
+static void heavyBarrier( void )
+{
+    if( not asymmetric_barrier or syscall( SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0 ) != 0 )
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+}
+
+// capacity is rounded up to a power of two
+Channel::Channel( size_t capacity, Kind k )
+: slots( std::bit_ceil( capacity < 2 ? 2 : capacity ))
+, mask( slots.size() - 1 )
+, kind( k )
+{
+    for( size_t i = 0; i < slots.size(); i++ )
+        slots[i].sequence.store( i, std::memory_order_relaxed );
+}
+
+// create a channel to be shared between VMs with VM::attachChannel
+std::shared_ptr<Channel> Channel::create( size_t capacity, Kind k )
+{
+    return std::make_shared<Channel>( capacity, k );
+}
+
+// non blocking, return false if the channel is full or closed
+bool Channel::trySend( uint16_t value )
+{
+    if( closed.load( std::memory_order_relaxed ))
+        return false;
+
+    size_t pos = tail.load( std::memory_order_relaxed );
+    for( ;; )
+    {
+        Slot& slot = slots[pos & mask];
+        size_t seq = slot.sequence.load( std::memory_order_acquire );
+        if( seq == pos ) // slot is free
+        {
+            if( kind == SPSC ) // single producer, no one else can take this position
+            {
+                tail.store( pos + 1, std::memory_order_relaxed );
+                break;
+            }
+            if( tail.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ))
+                break;
+        }
+        else if( seq < pos ) // the consumer has not freed this slot yet : full
+            return false;
+        else // another producer took this position
+            pos = tail.load( std::memory_order_relaxed );
+    }
+
+    Slot& slot = slots[pos & mask];
+    slot.value = value;
+    slot.sequence.store( pos + 1, std::memory_order_release ); // publish the value
+    wake();
+    return true;
+}
+
+// non blocking, return false if the channel is empty
+bool Channel::tryReceive( uint16_t& value )
+{
+    size_t pos = head.load( std::memory_order_relaxed );
+    Slot& slot = slots[pos & mask];
+    if( slot.sequence.load( std::memory_order_acquire ) != pos + 1 ) // not published yet
+        return false;
+
+    value = slot.value;
+    slot.sequence.store( pos + slots.size(), std::memory_order_release ); // free the slot for the next round
+    head.store( pos + 1, std::memory_order_relaxed );
+    wake();
+    return true;
+}
+
+// wake the parked senders and receivers, if any
+void Channel::wake( void )
+{
+    // orders the value or slot released before against the read of parked : a waiter either
+    // finds it when it tries again in park(), or is seen here. Only the first release after
+    // a waiter parked pays for the notification
+    lightBarrier();
+    if( not parked.load( std::memory_order_relaxed ) or not parked.exchange( false, std::memory_order_relaxed ))
+        return;
+    events.fetch_add( 1, std::memory_order_release );
+    events.notify_all();
+}
+
+// park until wake() or close(), unless 'ready' succeeds once registered as a waiter
+template<typename Ready>
+bool Channel::park( Ready ready )
+{
+    uint32_t seen = events.load( std::memory_order_acquire );
+    parked.store( true, std::memory_order_relaxed );
+    heavyBarrier(); // pairs with the barrier of wake()
+    if( ready() )
+        return true;
+    if( not closed.load( std::memory_order_acquire ))
+        events.wait( seen, std::memory_order_acquire );
+    return false;
+}
+
+// wait for room in the channel, return false if the channel is closed
+bool Channel::send( uint16_t value )
+{
+    unsigned spins = 0;
+    while( not trySend( value ))
+    {
+        if( closed.load( std::memory_order_relaxed ))
+            return false;
+        if( backoff( spins )) // the receiver is probably emptying a slot right now
+            continue;
+        if( park( [&]{ return trySend( value ); } ))
+            return true;
+    }
+    return true;
+}
+
+// wait for a value, return false if the channel is closed and empty
+bool Channel::receive( uint16_t& value )
+{
+    unsigned spins = 0;
+    while( not tryReceive( value ))
+    {
+        if( closed.load( std::memory_order_acquire ))
+            return tryReceive( value ); // a value may have been published just before closing
+        if( backoff( spins ))
+            continue;
+        if( park( [&]{ return tryReceive( value ); } ))
+            return true;
+    }
+    return true;
+}
+
+// wake up every blocked sender and receiver, no value can be sent afterward
+void Channel::close( void )
+{
+    closed.store( true, std::memory_order_release );
+    events.fetch_add( 1, std::memory_order_release );
+    events.notify_all();
+}
+
+bool Channel::isClosed( void ) const
+{
+    return closed.load( std::memory_order_acquire );
+}
+
+// trySend would find room, or fail because the channel is closed
+bool Channel::canSend( void ) const
+{
+    size_t pos = tail.load( std::memory_order_relaxed );
+    return slots[pos & mask].sequence.load( std::memory_order_acquire ) >= pos or isClosed();
+}
+
+// tryReceive would find a value, or the channel is closed
+bool Channel::canReceive( void ) const
+{
+    size_t pos = head.load( std::memory_order_relaxed );
+    return slots[pos & mask].sequence.load( std::memory_order_acquire ) == pos + 1 or isClosed();
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+
+//  +----------------------------------+
+//  |    Channels between VM instances |
+//  +----------------------------------+
+
+// bounded lock-free queue of words, used by SEND and RECV to move data between VMs without text
+// the consumer side must be a single thread, the producer side can be shared when kind is MPSC
+class Channel
+{
+public:
+    enum Kind
+    {
+        SPSC,   // one producer, one consumer : no atomic read-modify-write on the hot path
+        MPSC    // several producers ( threads or VMs ), one consumer
+    };
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> sequence;   // tell whether the slot is ready to be written or read
+        uint16_t value;
+    };
+
+    // keep producers and consumer indexes on different cache lines
+    alignas( 64 ) std::atomic<size_t> tail{ 0 };  // next position to write
+    alignas( 64 ) std::atomic<size_t> head{ 0 };  // next position to read
+    alignas( 64 ) std::atomic<bool> closed{ false };
+    std::atomic<uint32_t> events{ 0 };     // bumped when a value or a slot is released while someone sleeps
+    std::atomic<bool> parked{ false };     // a sender or a receiver waits on events since the last bump
+    std::vector<Slot> slots;
+    size_t mask;
+    Kind kind;
+
+public:
+    // capacity is rounded up to a power of two
+    Channel( size_t capacity, Kind k );
+
+    // create a channel to be shared between VMs with VM::attachChannel
+    static std::shared_ptr<Channel> create( size_t capacity, Kind k = SPSC );
+
+    // non blocking, return false if the channel is full or closed
+    bool trySend( uint16_t value );
+
+    // non blocking, return false if the channel is empty
+    bool tryReceive( uint16_t& value );
+
+    // wait for room in the channel, return false if the channel is closed. Spins briefly, then
+    // sleeps until a receiver frees a slot
+    bool send( uint16_t value );
+
+    // wait for a value, return false if the channel is closed and empty. Spins briefly, then
+    // sleeps until a sender publishes a value
+    bool receive( uint16_t& value );
+
+    // trySend would find room, or fail because the channel is closed
+    bool canSend( void ) const;
+
+    // tryReceive would find a value, or the channel is closed
+    bool canReceive( void ) const;
+
+    // wake up every blocked sender and receiver, no value can be sent afterward
+    void close( void );
+
+    bool isClosed( void ) const;
+
+    size_t capacity( void ) const { return slots.size(); }
+
+private:
+    // wake the parked senders and receivers, if any
+    void wake( void );
+
+    // park until wake() or close(), unless 'ready' succeeds once registered as a waiter
+    template<typename Ready>
+    bool park( Ready ready );
+};
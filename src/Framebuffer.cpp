@@ -0,0 +1,72 @@
+#include <algorithm>
+#include <string>
+
+#include "Framebuffer.h"
+#include "misc.h"
+
+
+// the region [address, address + width * height[ must fit in the memory
+Framebuffer::Framebuffer( uint16_t fb_address, uint16_t fb_width, uint16_t fb_height )
+: address( fb_address )
+, width( fb_width )
+, height( fb_height )
+, shown( static_cast<size_t>( fb_width ) * fb_height, 0 )
+, dirty( fb_height, false )
+{
+    if( width == 0 or height == 0 or address + shown.size() > 65536 )
+        Error( "Framebuffer does not fit in the memory" );
+}
+
+// append the character of a cell
+static void appendCell( std::string& out, uint16_t cell )
+{
+    uint8_t c = static_cast<uint8_t>( cell & 0xFF );
+    if( cell == 219 )   // Extended ASCII, allow to draw "█", like DISP
+        out += "█";
+    else if( c < 0x20 or c >= 0x7F ) // 0 and control characters
+        out += ' ';
+    else
+        out += static_cast<char>( c );
+}
+
+// append to 'out' the drawing of the rows changed since the last call, return the amount of rows
+size_t Framebuffer::render( const uint16_t* memory, bool terminal, std::string& out )
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    const uint16_t* cells = memory + address;
+
+    // dirty bitmap : rows that differ from what is shown, the first frame is entirely dirty
+    size_t count = 0;
+    for( size_t row = 0; row < height; row++ )
+    {
+        const uint16_t* line = cells + row * width;
+        dirty[row] = first or not std::equal( line, line + width, shown.begin() + static_cast<std::ptrdiff_t>( row * width ));
+        if( dirty[row] )
+        {
+            std::copy( line, line + width, shown.begin() + static_cast<std::ptrdiff_t>( row * width ));
+            count++;
+        }
+    }
+    if( count == 0 )
+        return 0;
+
+    if( terminal and first )
+        out += "\x1b[H\x1b[2J";
+    for( size_t row = 0; row < height; row++ )
+    {
+        if( terminal and not dirty[row] )
+            continue;
+        if( terminal )
+            out += "\x1b[" + std::to_string( row + 1 ) + ";1H";
+        for( size_t column = 0; column < width; column++ )
+            appendCell( out, shown[row * width + column] );
+        if( not terminal )
+            out += '\n';
+    }
+    if( terminal ) // leave the cursor below the grid
+        out += "\x1b[" + std::to_string( height + 1 ) + ";1H";
+    else
+        out += '\n';
+    first = false;
+    return count;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+//  +---------------------+
+//  |    Framebuffer      |
+//  +---------------------+
+
+// a region of the guest memory shown as a grid of characters, one word per cell ( low byte, 0 is a
+// space and 219 is drawn as █ ). The guest draws with plain stores : rows written since the last
+// presentation are found by comparing them with the cells shown, and only those rows are drawn
+class Framebuffer
+{
+private:
+    uint16_t address;
+    uint16_t width;
+    uint16_t height;
+    std::vector<uint16_t> shown;    // cells presented last time
+    std::vector<bool> dirty;        // by row, rows that differ from the cells shown
+    bool first = true;              // nothing shown yet
+    std::mutex mutex;               // presented by any thread of the VM
+
+public:
+    // the region [address, address + width * height[ must fit in the memory
+    Framebuffer( uint16_t fb_address, uint16_t fb_width, uint16_t fb_height );
+
+    uint16_t getAddress( void ) const { return address; }
+    uint16_t getWidth( void ) const { return width; }
+    uint16_t getHeight( void ) const { return height; }
+
+    // append to 'out' the drawing of the rows changed since the last call, return the amount of rows
+    // terminal : the rows are redrawn in place with ANSI cursor moves, otherwise the whole grid is
+    // appended as plain text when any row changed
+    size_t render( const uint16_t* memory, bool terminal, std::string& out );
+};
@@ -0,0 +1,176 @@
+#include <bit>
+
+#include "Heap.h"
+#include "misc.h"
+
+
+// share of live words lost to rounding up to a size class
+double HeapStats::internalFragmentation( void ) const
+{
+    if( live_words == 0 ) return 0.0;
+    return 1.0 - static_cast<double>( requested_words ) / live_words;
+}
+
+// share of unused words that are stuck in free lists instead of the untouched area
+double HeapStats::externalFragmentation( void ) const
+{
+    uint32_t unused = heap_words - live_words;
+    if( unused == 0 ) return 0.0;
+    return static_cast<double>( free_words ) / unused;
+}
+
+// manage the words [base, base + size[ of the guest memory, forget every previous block
+void Heap::configure( uint16_t heap_base, uint32_t heap_size )
+{
+    if( heap_base == 0 )
+        Error( "Heap cannot start at address 0, it is used to signal a failed allocation" );
+    if( heap_base + heap_size > UINT16_MAX )
+        Error( "Heap does not fit in the guest memory" );
+
+    base = heap_base;
+    size = heap_size;
+    top  = 0;
+    for( auto& list : free_lists )
+        list.clear();
+    block_class.clear();    // allocated by the first allocation
+    block_request.clear();
+
+    stats = HeapStats();
+    stats.heap_words = size;
+}
+
+// size class needed to hold 'words' words
+uint8_t Heap::sizeClass( uint16_t words )
+{
+    if( words <= 1 ) return 0;
+    return static_cast<uint8_t>( std::bit_width( static_cast<uint16_t>( words - 1 )));
+}
+
+// return the address of a block of at least 'words' words, or 0 if it cannot be served
+uint16_t Heap::allocate( uint16_t words )
+{
+    if( words == 0 )
+        words = 1;
+
+    uint8_t  cls = sizeClass( words );
+    uint32_t block_size = 1u << cls;
+    uint32_t offset;
+
+    if( not free_lists[cls].empty() ) // reuse a freed block of the same class
+    {
+        offset = free_lists[cls].back() - base;
+        free_lists[cls].pop_back();
+        stats.free_words -= block_size;
+    }
+    else if( top + block_size <= size ) // carve a new block from the untouched area
+    {
+        offset = top;
+        top += block_size;
+        stats.carved_words = top;
+    }
+    else
+    {
+        stats.failures++;
+        return 0;
+    }
+
+    track();
+    block_class[offset]   = static_cast<uint8_t>( cls + 1 );
+    block_request[offset] = words;
+    stats.live_words      += block_size;
+    stats.requested_words += words;
+    stats.allocations++;
+    return static_cast<uint16_t>( base + offset );
+}
+
+// give a block back to its free list, return false if address is not a live block
+bool Heap::release( uint16_t address )
+{
+    if( address < base or address >= base + size )
+        return false;
+
+    uint32_t offset = address - base;
+    if( block_class.empty() or block_class[offset] == 0 ) // not the start of a live block, or already freed
+        return false;
+
+    uint8_t  cls = static_cast<uint8_t>( block_class[offset] - 1 );
+    uint32_t block_size = 1u << cls;
+
+    free_lists[cls].push_back( address );
+    stats.free_words      += block_size;
+    stats.live_words      -= block_size;
+    stats.requested_words -= block_request[offset];
+    stats.frees++;
+
+    block_class[offset]   = 0;
+    block_request[offset] = 0;
+    return true;
+}
+
+// whole state of the heap as words : region, statistics, free lists, then live blocks
+std::vector<uint32_t> Heap::save( void ) const
+{
+    std::vector<uint32_t> state = { base, size, top,
+                                    stats.heap_words, stats.carved_words, stats.live_words, stats.requested_words,
+                                    stats.free_words, stats.allocations, stats.frees, stats.failures };
+
+    for( const auto& list : free_lists )
+    {
+        state.push_back( static_cast<uint32_t>( list.size() ));
+        state.insert( state.end(), list.begin(), list.end() );
+    }
+    for( uint32_t offset = 0; offset < block_class.size(); offset++ )
+        if( block_class[offset] != 0 )
+            state.insert( state.end(), { offset, block_class[offset], block_request[offset] });
+    return state;
+}
+
+// replace the state by one made by save(), return false if it is malformed
+bool Heap::restore( const std::vector<uint32_t>& state )
+{
+    size_t i = 11;
+    if( state.size() < i or state[0] + state[1] > UINT16_MAX or state[2] > state[1] or ( state[0] == 0 and state[1] != 0 ))
+        return false;
+
+    if( state[0] == 0 ) // never configured, no ALLOC ran
+        *this = Heap();
+    else
+        configure( static_cast<uint16_t>( state[0] ), state[1] );
+    top = state[2];
+    stats = HeapStats{ state[3], state[4], state[5], state[6], state[7], state[8], state[9], state[10] };
+
+    for( auto& list : free_lists )
+    {
+        if( i >= state.size() or state.size() - i - 1 < state[i] )
+            return false;
+        list.assign( state.begin() + static_cast<std::ptrdiff_t>( i + 1 ), state.begin() + static_cast<std::ptrdiff_t>( i + 1 + state[i] ));
+        i += 1 + state[i];
+    }
+    for( ; i + 2 < state.size(); i += 3 )
+    {
+        if( state[i] >= size or state[i + 1] == 0 or state[i + 1] > CLASS_COUNT )
+            return false;
+        track();
+        block_class[state[i]]   = static_cast<uint8_t>( state[i + 1] );
+        block_request[state[i]] = static_cast<uint16_t>( state[i + 2] );
+    }
+    return i == state.size();
+}
+
+// host memory held by the allocator, in bytes
+size_t Heap::footprint( void ) const
+{
+    size_t bytes = sizeof( Heap ) + block_class.capacity() + block_request.capacity() * sizeof( uint16_t );
+    for( const auto& list : free_lists )
+        bytes += list.capacity() * sizeof( uint16_t );
+    return bytes;
+}
+
+// allocate the bookkeeping of every word, a heap never used costs nothing
+void Heap::track( void )
+{
+    if( block_class.size() == size )
+        return;
+    block_class.assign( size, 0 );
+    block_request.assign( size, 0 );
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <array>
+
+
+//  +----------------------------------+
+//  |    Guest Heap ( size classes )   |
+//  +----------------------------------+
+
+// statistics about the heap, used to observe fragmentation
+struct HeapStats
+{
+    uint32_t heap_words      = 0;   // size of the heap region
+    uint32_t carved_words    = 0;   // words already handed out by the bump pointer at least once
+    uint32_t live_words      = 0;   // words held by live blocks ( rounded to their size class )
+    uint32_t requested_words = 0;   // words asked by the guest for live blocks
+    uint32_t free_words      = 0;   // words waiting in the free lists
+    uint32_t allocations     = 0;   // successful ALLOC count
+    uint32_t frees           = 0;   // FREE count
+    uint32_t failures        = 0;   // ALLOC that could not be served
+
+    // share of live words lost to rounding up to a size class
+    double internalFragmentation( void ) const;
+    // share of unused words that are stuck in free lists instead of the untouched area
+    double externalFragmentation( void ) const;
+};
+
+// host-side allocator managing a region of the guest address space
+// every block size is rounded up to a power of two, each size class has its own free list,
+// so both allocate() and release() are O(1). Bookkeeping lives on the host, not in guest memory.
+class Heap
+{
+public:
+    static const uint8_t CLASS_COUNT = 17;  // 2^0 to 2^16 words
+
+private:
+    uint32_t base = 0;      // first guest address of the heap
+    uint32_t size = 0;      // amount of words managed
+    uint32_t top  = 0;      // bump pointer, offset of the first never allocated word
+    std::array<std::vector<uint16_t>, CLASS_COUNT> free_lists;  // freed blocks addresses, by size class
+    std::vector<uint8_t>  block_class;      // by offset: size class + 1 of a live block, 0 otherwise, empty until the first allocation
+    std::vector<uint16_t> block_request;    // by offset: size asked for a live block, empty until the first allocation
+    HeapStats stats;
+
+public:
+    // manage the words [base, base + size[ of the guest memory, forget every previous block
+    void configure( uint16_t heap_base, uint32_t heap_size );
+
+    // return the address of a block of at least 'words' words, or 0 if it cannot be served
+    uint16_t allocate( uint16_t words );
+
+    // give a block back to its free list, return false if address is not a live block
+    bool release( uint16_t address );
+
+    uint16_t getBase( void ) const { return static_cast<uint16_t>( base ); }
+    uint32_t getSize( void ) const { return size; }
+    const HeapStats& getStats( void ) const { return stats; }
+
+    // size class needed to hold 'words' words
+    static uint8_t sizeClass( uint16_t words );
+
+    // host memory held by the allocator, in bytes
+    size_t footprint( void ) const;
+
+    // whole state of the heap as words, given back to restore() by snapshots
+    std::vector<uint32_t> save( void ) const;
+
+    // replace the state by one made by save(), return false if it is malformed
+    bool restore( const std::vector<uint32_t>& state );
+
+private:
+    // allocate the bookkeeping of every word, a heap never used costs nothing
+    void track( void );
+};
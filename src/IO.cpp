@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <utility>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "IO.h"
+#include "misc.h"
+
+
+// size of the blocks read from the backend
+static const size_t READ_BLOCK = 65536;
+
+static bool isBlank( char c )
+{
+    return c == ' ' or c == '\n' or c == '\t' or c == '\r' or c == '\v' or c == '\f';
+}
+
+// value of a digit in 'base', -1 if it is not one
+static int digitValue( char c, int base )
+{
+    int digit = -1;
+    if( c >= '0' and c <= '9' )      digit = c - '0';
+    else if( c >= 'a' and c <= 'f' ) digit = c - 'a' + 10;
+    else if( c >= 'A' and c <= 'F' ) digit = c - 'A' + 10;
+    return digit < base ? digit : -1;
+}
+
+// INPUT char : next character which is not blank, 0 at the end of the input
+char IOBackend::readChar( void )
+{
+    std::lock_guard<std::mutex> lock( input_mutex );
+    if( not skipBlanks() )
+        return 0;
+    return *cursor++;
+}
+
+// INPUT int, mem, hex, bin : parse the next word as a number in base 10, 16 ( 0x... ) or 2 ( 0b... )
+bool IOBackend::readNumber( int base, uint16_t& value )
+{
+    std::lock_guard<std::mutex> lock( input_mutex );
+    std::string_view word = nextWord();
+    value = 0;
+
+    if( base == 10 ) // leading digits, like the extraction of an integer from a stream
+    {
+        size_t i = ( not word.empty() and ( word[0] == '-' or word[0] == '+' )) ? 1 : 0;
+        int32_t number = 0;
+        for( ; i < word.size() and digitValue( word[i], 10 ) >= 0; i++ )
+        {
+            number = number * 10 + digitValue( word[i], 10 );
+            if( number > UINT16_MAX ) // does not fit a word, whatever the sign
+                return false;
+        }
+        value = static_cast<uint16_t>( word.starts_with( '-' ) ? -number : number );
+        return true;
+    }
+
+    // 0x or 0b, then digits only, otherwise the word reads as 0
+    if( word.size() < 3 or word[0] != '0' or word[1] != ( base == 16 ? 'x' : 'b' ))
+        return true;
+    uint32_t number = 0;
+    for( size_t i = 2; i < word.size(); i++ )
+    {
+        int digit = digitValue( word[i], base );
+        if( digit < 0 )
+            return true;
+        number = number * static_cast<uint32_t>( base ) + static_cast<uint32_t>( digit );
+    }
+    size_t max_digits = base == 16 ? 4 : 16;
+    if( word.size() - 2 > max_digits )
+        return false;
+    value = static_cast<uint16_t>( number );
+    return true;
+}
+
+// INPUT str : copy the rest of the current line, one character per word, to at most 'capacity' words
+size_t IOBackend::readLine( uint16_t* words, size_t capacity )
+{
+    std::lock_guard<std::mutex> lock( input_mutex );
+    size_t length = 0;
+    const char* keep = limit; // the line is copied as it goes, nothing to keep
+    while( cursor < limit or refill( keep = limit ))
+    {
+        char c = *cursor++;
+        if( c == '\n' )
+            break;
+        if( length < capacity )
+            words[length] = static_cast<unsigned char>( c );
+        length++;
+    }
+    return length;
+}
+
+// true if INPUT would not block, waiting at most 'timeout_ms' milliseconds ( forever if negative )
+bool IOBackend::inputReady( int timeout_ms )
+{
+    {
+        std::lock_guard<std::mutex> lock( input_mutex );
+        if( cursor < limit or input_end )
+            return true;
+    }
+    return waitInput( timeout_ms );
+}
+
+// scan 'data' as the whole input, read() is not called afterward
+void IOBackend::setInput( const char* data, size_t length )
+{
+    std::lock_guard<std::mutex> lock( input_mutex );
+    cursor = data;
+    limit = data + length;
+    input_end = true;
+}
+
+// read the next block, keeping the input from 'keep' to limit in front of it
+bool IOBackend::refill( const char*& keep )
+{
+    if( input_end )
+        return false;
+    size_t kept = static_cast<size_t>( limit - keep );
+    size_t scanned = static_cast<size_t>( cursor - keep );
+    if( kept > 0 ) // keep points into block
+        std::memmove( block.data(), keep, kept );
+    block.resize( kept + READ_BLOCK );
+    size_t length = read( block.data() + kept, READ_BLOCK );
+    block.resize( kept + length );
+    keep   = block.data();
+    cursor = block.data() + scanned;
+    limit  = block.data() + block.size();
+    if( length == 0 )
+        input_end = true;
+    return length > 0;
+}
+
+// skip blanks, return false at the end of the input
+bool IOBackend::skipBlanks( void )
+{
+    while( true )
+    {
+        while( cursor < limit and isBlank( *cursor ))
+            cursor++;
+        if( cursor < limit )
+            return true;
+        const char* keep = limit; // nothing to keep
+        if( not refill( keep ))
+            return false;
+    }
+}
+
+// next word, in place, valid until the next refill
+std::string_view IOBackend::nextWord( void )
+{
+    if( not skipBlanks() )
+        return {};
+    const char* start = cursor;
+    while( true )
+    {
+        while( cursor < limit and not isBlank( *cursor ))
+            cursor++;
+        if( cursor < limit or not refill( start )) // the word may go on in the next block
+            break;
+    }
+    return std::string_view( start, static_cast<size_t>( cursor - start ));
+}
+
+
+
+//  +----------------------+
+//  |     File Backend     |
+//  +----------------------+
+
+// 'owned' : the backend closes the descriptors when destroyed
+FdBackend::FdBackend( int in, int out, bool owned_fds )
+: input_fd( in )
+, output_fd( out )
+, owned( owned_fds )
+, terminal( isatty( out ) == 1 )
+{
+}
+
+FdBackend::~FdBackend()
+{
+    if( not owned )
+        return;
+    close( input_fd );
+    if( output_fd != input_fd )
+        close( output_fd );
+}
+
+// write every byte, unless the file descriptor fails
+void FdBackend::write( const char* text, size_t length )
+{
+    size_t written = 0;
+    while( written < length )
+    {
+        ssize_t n = ::write( output_fd, text + written, length - written );
+        if( n < 0 and errno == EINTR )
+            continue;
+        if( n <= 0 ) // nowhere to write, drop the text rather than block the guest
+            return;
+        written += static_cast<size_t>( n );
+    }
+}
+
+// rows and columns of the terminal written to, false if unknown
+bool FdBackend::windowSize( size_t& rows, size_t& columns ) const
+{
+    winsize size;
+    if( not terminal or ioctl( output_fd, TIOCGWINSZ, &size ) != 0 or size.ws_row == 0 or size.ws_col == 0 )
+        return false;
+    rows = size.ws_row;
+    columns = size.ws_col;
+    return true;
+}
+
+// read at most 'capacity' bytes, 0 at the end of the input or on failure
+size_t FdBackend::read( char* buffer, size_t capacity )
+{
+    while( true )
+    {
+        ssize_t n = ::read( input_fd, buffer, capacity );
+        if( n < 0 and errno == EINTR )
+            continue;
+        return n > 0 ? static_cast<size_t>( n ) : 0;
+    }
+}
+
+// wait at most 'timeout_ms' for the descriptor to be readable
+bool FdBackend::waitInput( int timeout_ms )
+{
+    pollfd ready{ input_fd, POLLIN, 0 };
+    return poll( &ready, 1, timeout_ms ) > 0;
+}
+
+MappedInputBackend::MappedInputBackend( const std::string& path, int out )
+: FdBackend( -1, out )
+{
+    int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+    if( fd < 0 )
+        Error( "Cannot open the input file '" + path + "'" );
+    struct stat info;
+    if( fstat( fd, &info ) != 0 )
+        Error( "Cannot read the size of the input file '" + path + "'" );
+    mapping_size = static_cast<size_t>( info.st_size );
+    if( mapping_size > 0 )
+    {
+        mapping = mmap( nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( mapping == MAP_FAILED )
+            Error( "Cannot map the input file '" + path + "'" );
+        madvise( mapping, mapping_size, MADV_SEQUENTIAL ); // read once, front to back
+    }
+    close( fd ); // the mapping keeps the file
+    setInput( static_cast<const char*>( mapping ), mapping_size );
+}
+
+MappedInputBackend::~MappedInputBackend()
+{
+    if( mapping != nullptr )
+        munmap( mapping, mapping_size );
+}
+
+TerminalBackend::TerminalBackend()
+: FdBackend( STDIN_FILENO, STDOUT_FILENO )
+{
+}
+
+
+
+//  +----------------------+
+//  |    Memory Backend    |
+//  +----------------------+
+
+MemoryBackend::MemoryBackend( std::string text )
+: source( std::move( text ))
+{
+}
+
+void MemoryBackend::write( const char* text, size_t length )
+{
+    written.append( text, length );
+}
+
+size_t MemoryBackend::read( char* buffer, size_t capacity )
+{
+    size_t length = std::min( capacity, source.size() - source_cursor );
+    std::copy_n( source.data() + source_cursor, length, buffer );
+    source_cursor += length;
+    return length;
+}
@@ -0,0 +1,157 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+
+
+//  +----------------------+
+//  |     I/O Backends     |
+//  +----------------------+
+
+// console of a VM : where the text of DISP goes and where INPUT reads from. Chosen once, before the
+// program starts. Output reaches the backend a whole buffer at a time ( see OutputBuffer ) and input
+// is read by blocks, or mapped at once, then scanned in place here, so the guest never pays a
+// virtual call per character
+class IOBackend
+{
+private:
+    std::string block;              // last block read, with the start of a word cut by the previous one
+    const char* cursor = nullptr;   // input not scanned yet : [cursor, limit[
+    const char* limit = nullptr;
+    bool input_end = false;         // nothing more to read after limit
+    std::mutex input_mutex;         // threads of a VM share the console
+
+public:
+    virtual ~IOBackend() = default;
+
+    // write text, called once per flush of the output buffer
+    virtual void write( const char* text, size_t length ) = 0;
+
+    // text written to a terminal, CLS draws frames with ANSI sequences
+    virtual bool isTerminal( void ) const { return false; }
+
+    // rows and columns of the terminal written to, false if unknown
+    virtual bool windowSize( size_t& /* rows */, size_t& /* columns */ ) const { return false; }
+
+    // file descriptor INPUT reads from, for schedulers waiting on many consoles. -1 if there is none
+    virtual int inputDescriptor( void ) const { return -1; }
+
+    // INPUT char : next character which is not blank, 0 at the end of the input
+    char readChar( void );
+
+    // INPUT int, mem, hex, bin : parse the next word delimited by blanks as a number in base 10
+    // ( leading digits, signed ), 16 ( 0x... ) or 2 ( 0b... ). 'value' is 0 if the word is not
+    // such a number or at the end of the input. Return false if the number has too many digits, or
+    // in base 10 if its magnitude is above 65535
+    bool readNumber( int base, uint16_t& value );
+
+    // INPUT str : copy the rest of the current line, one character per word, to at most 'capacity'
+    // words. The end of line is consumed but not copied. Return the length of the line
+    size_t readLine( uint16_t* words, size_t capacity );
+
+    // true if INPUT would not block, waiting at most 'timeout_ms' milliseconds ( forever if negative )
+    bool inputReady( int timeout_ms );
+
+protected:
+    // read at most 'capacity' bytes, 0 at the end of the input
+    virtual size_t read( char* buffer, size_t capacity ) = 0;
+
+    // scan 'data' as the whole input, ex: a mapped file. read() is not called afterward
+    void setInput( const char* data, size_t length );
+
+    // wait at most 'timeout_ms' for read() to have something, true if it would not block
+    virtual bool waitInput( int /* timeout_ms */ ) { return true; }
+
+private:
+    // read the next block, keeping the input from 'keep' to limit in front of it
+    // 'keep' is moved along. Return false at the end of the input
+    bool refill( const char*& keep );
+
+    // skip blanks, return false at the end of the input
+    bool skipBlanks( void );
+
+    // next word, in place, valid until the next refill
+    std::string_view nextWord( void );
+};
+
+// reads and writes file descriptors, ex: pipes or files of a batch job
+class FdBackend : public IOBackend
+{
+private:
+    int input_fd;
+    int output_fd;
+    bool owned;         // close both descriptors with the backend
+    bool terminal;
+
+public:
+    // 'owned' : the backend closes the descriptors when destroyed
+    FdBackend( int input_fd, int output_fd, bool owned = false );
+    ~FdBackend() override;
+
+    FdBackend( const FdBackend& ) = delete;
+    FdBackend& operator=( const FdBackend& ) = delete;
+
+    void write( const char* text, size_t length ) override;
+    bool isTerminal( void ) const override { return terminal; }
+    bool windowSize( size_t& rows, size_t& columns ) const override;
+    int inputDescriptor( void ) const override { return input_fd; }
+
+protected:
+    size_t read( char* buffer, size_t capacity ) override;
+    bool waitInput( int timeout_ms ) override;
+};
+
+// input file mapped in memory and scanned in place, without copies, output to a file descriptor
+class MappedInputBackend : public FdBackend
+{
+private:
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+
+public:
+    MappedInputBackend( const std::string& path, int out = STDOUT_FILENO );
+    ~MappedInputBackend() override;
+
+protected:
+    bool waitInput( int ) override { return true; }
+};
+
+// standard input and output of the process, the default backend
+class TerminalBackend : public FdBackend
+{
+public:
+    TerminalBackend();
+};
+
+// input given up front, output kept in memory, ex: tests or a VM embedded in a service
+class MemoryBackend : public IOBackend
+{
+private:
+    std::string source;         // input not read yet
+    size_t source_cursor = 0;
+    std::string written;
+
+public:
+    explicit MemoryBackend( std::string text = "" );
+
+    void write( const char* text, size_t length ) override;
+
+    // text written so far, read it once the VM is stopped
+    const std::string& output( void ) const { return written; }
+
+protected:
+    size_t read( char* buffer, size_t capacity ) override;
+};
+
+// discards the output, the input is empty
+class NullBackend : public IOBackend
+{
+public:
+    void write( const char*, size_t ) override {}
+
+protected:
+    size_t read( char*, size_t ) override { return 0; }
+};
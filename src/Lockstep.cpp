@@ -0,0 +1,405 @@
+#include <algorithm>
+#include <bit>
+
+#include "Lockstep.h"
+#include "VM.h"
+#include "misc.h"
+
+
+static const unsigned LANES = LockstepEngine::LANES;
+
+// vector steps run by one call of laneSteps(), the counters in Lanes::retired must not wrap
+static const unsigned STEP_BUDGET = 32768;
+
+// steps between two looks for lanes waiting more than DIVERGENCE_LIMIT steps
+static const unsigned DIVERGENCE_CHECK = 64;
+
+// bits of the flags in Lanes::flags
+static const uint16_t ZERO_FLAGS     = ( 1 << EQU ) | ( 1 << ZRO );
+static const uint16_t POSITIVE_FLAG  = 1 << POS;
+static const uint16_t NEGATIVE_FLAG  = 1 << NEG;
+static const uint16_t OVERFLOW_FLAG  = 1 << OVF;
+static const uint16_t ODD_FLAG       = 1 << ODD;
+
+using Words = LockstepEngine::Words;
+using Signed [[gnu::vector_size( sizeof( Words ))]] = int16_t;
+
+// the helpers below are inlined in laneSteps(), their vectors never go through a call without AVX
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+// Masks are 0xFFFF where a condition holds and 0 elsewhere, built with shifts rather than comparisons
+// which have no SSE2 instruction for unsigned words
+
+// sign bit of every word
+static inline Words negative( const Words& words )
+{
+    return __builtin_convertvector( __builtin_convertvector( words, Signed ) >> 15, Words );
+}
+
+// words equal to 0
+static inline Words zero( const Words& words )
+{
+    return ~negative( words | -words );
+}
+
+// value where mask is set, other elsewhere
+static inline Words blend( const Words& mask, const Words& value, const Words& other )
+{
+    return ( value & mask ) | ( other & ~mask );
+}
+
+// the lowest word
+static inline uint16_t lowest( const Words& words )
+{
+    static_assert( LANES == 16 );
+    Words v = words;
+    Words swapped = __builtin_shuffle( v, Words{ 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7 } );
+    v = v < swapped ? v : swapped;
+    swapped = __builtin_shuffle( v, Words{ 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3 } );
+    v = v < swapped ? v : swapped;
+    swapped = __builtin_shuffle( v, Words{ 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1 } );
+    v = v < swapped ? v : swapped;
+    swapped = __builtin_shuffle( v, Words{ 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0 } );
+    v = v < swapped ? v : swapped;
+    return v[0];
+}
+
+// a word of mask is set
+static inline bool any( const Words& mask )
+{
+    return lowest( ~mask ) == 0;
+}
+
+// run every VM until its program halts, LANES at a time
+void LockstepEngine::run( const std::vector<VM*>& machines )
+{
+    for( size_t first = 0; first < machines.size(); first += LANES )
+        runGroup( machines.data() + first, static_cast<unsigned>( std::min<size_t>( LANES, machines.size() - first )));
+}
+
+// run up to LANES VMs in lockstep, then finish the lanes split off
+void LockstepEngine::runGroup( VM* const* machines, unsigned count )
+{
+    const std::vector<uint32_t>& code = *machines[0]->program;
+    decode( code );
+    lanes.mask = lanes.waiting = lanes.retired = Words{};
+    for( unsigned lane = 0; lane < LANES; lane++ )
+    {
+        vms[lane] = lane < count ? machines[lane] : nullptr;
+        lanes.live[lane] = lane < count ? 0xFFFF : 0;
+        if( vms[lane] == nullptr )
+        {
+            lanes.reg[ip][lane] = 0;
+            continue;
+        }
+        if( vms[lane]->program != machines[0]->program and *vms[lane]->program != code )
+            Error( "Lanes run in lockstep must share their program" );
+        fetch( lane );
+        // the scalar interpreter polls interrupts and runs programs spanning several segments
+        if( vms[lane]->interrupts_armed or vms[lane]->code_segment != 0 or code.size() >= 65536 )
+            split( lane );
+    }
+
+    for( ;; )
+    {
+        // a lane left alone runs faster in the scalar interpreter
+        unsigned remaining = 0;
+        unsigned alone = 0;
+        for( unsigned lane = 0; lane < LANES; lane++ )
+            if( lanes.live[lane] )
+            {
+                remaining++;
+                alone = lane;
+            }
+        if( remaining == 1 )
+            split( alone );
+
+        Pause pause = laneSteps();
+        flushRetired();
+        if( pause == HALTED )
+            break;
+        if( pause == SCALAR )
+            scalarStep();
+        else if( pause == DIVERGED ) // waiting longer would cost more than running it alone
+        {
+            for( unsigned lane = 0; lane < LANES; lane++ )
+                if( lanes.live[lane] and lanes.waiting[lane] > DIVERGENCE_LIMIT )
+                    split( lane );
+        }
+    }
+
+    for( VM* vm : scalar )
+        vm->start(); // resumes where the lane stopped
+    scalar.clear();
+}
+
+// fill 'decoded' from the program
+void LockstepEngine::decode( const std::vector<uint32_t>& code )
+{
+    static const LaneKind add_based[] = { LANE_SCALAR, LANE_ADD, LANE_SUB, LANE_COPY, LANE_CMP, LANE_MUL, LANE_DIV, LANE_MOD };
+    static const LaneKind bin_based[] = { LANE_SCALAR, LANE_AND, LANE_OR, LANE_NOT, LANE_XOR };
+
+    decoded.assign( code.size() + 1, LaneInstruction() ); // past the end, left to the scalar interpreter
+    for( size_t address = 0; address < code.size(); address++ )
+    {
+        uint32_t instruction = code[address];
+        LaneInstruction& decoding = decoded[address];
+        OP op = getInstruction( instruction );
+        uint16_t mode = ( instruction & 0x0F000000 ) >> 24;
+        decoding.value = instruction & 0x0000FFFF;
+
+        if( op >= ADD and op <= MOD ) // register destination, register or immediate source
+        {
+            uint16_t l_mode = mode >> 2;
+            uint16_t r_mode = mode & 0b0011;
+            uint16_t dest_reg = ( instruction & 0x00F00000 ) >> 20;
+            uint16_t src_reg  = ( instruction & 0x000000F0 ) >> 4;
+            if( r_mode != 2 or dest_reg == ip or ( l_mode != 0 and l_mode != 2 ) or ( l_mode == 2 and src_reg == ip ))
+                continue;
+            decoding.dest = static_cast<uint8_t>( dest_reg );
+            decoding.src = static_cast<uint8_t>( src_reg );
+            decoding.immediate = l_mode == 0;
+            decoding.kind = add_based[op];
+            if( decoding.immediate and ( op == MUL or op == DIV or op == MOD ))
+            {
+                if( decoding.value == 0 ) // faults, leave it to the scalar interpreter
+                    decoding.kind = LANE_SCALAR;
+                else if( op == DIV and std::has_single_bit( decoding.value ))
+                {
+                    decoding.kind = LANE_SHR;
+                    decoding.value = static_cast<uint16_t>( std::countr_zero( decoding.value ));
+                }
+                else if( op == MOD and std::has_single_bit( decoding.value ))
+                {
+                    decoding.kind = LANE_MASK;
+                    decoding.value = static_cast<uint16_t>( decoding.value - 1 );
+                }
+            }
+        }
+        else if( op == BIN and mode >= 1 and mode <= 4 )
+        {
+            uint16_t l_mode   = ( instruction & 0x00F00000 ) >> 20;
+            uint16_t dest_reg = ( instruction & 0x000F0000 ) >> 16;
+            uint16_t src_reg  = ( instruction & 0x0000F000 ) >> 12;
+            if( dest_reg == ip or ( l_mode == 2 and src_reg == ip ))
+                continue;
+            decoding.dest = static_cast<uint8_t>( dest_reg );
+            decoding.src = static_cast<uint8_t>( src_reg );
+            decoding.immediate = l_mode != 2;
+            decoding.kind = bin_based[mode];
+        }
+        else if( op == JUMP and mode == 0 )
+            decoding.kind = LANE_JUMP;
+        else if( op == JUMP and mode == 3 ) // calls and returns use the stack
+        {
+            uint16_t flag = ( instruction & 0x000F0000 ) >> 16;
+            if( flag >= F_COUNT ) // an error raised by the scalar interpreter
+                continue;
+            decoding.kind = LANE_JUMP_IF;
+            decoding.dest = static_cast<uint8_t>( flag );
+            decoding.src = static_cast<uint8_t>(( instruction & 0x00F00000 ) >> 20 );
+        }
+    }
+}
+
+// vector steps until an instruction must run lane by lane, a lane diverged or every lane halted
+[[gnu::target_clones( "avx2", "default" )]]
+LockstepEngine::Pause LockstepEngine::laneSteps( void )
+{
+    const LaneInstruction* code = decoded.data();
+    Words& address = lanes.reg[ip];
+    const Words& mask = lanes.mask;
+    Pause pause = BUDGET;
+    unsigned step = 0;
+    uint16_t pc = 0;
+    bool converged = false; // every live lane is at pc, 'mask' is 'live' and nothing waits
+
+    for( ; step < STEP_BUDGET; step++ )
+    {
+        if( not converged )
+        {
+            // the lowest address runs first : the lanes which branched ahead wait there for the others
+            pc = lowest( address | ~lanes.live );
+            if( pc == UINT16_MAX ) // programs run in lockstep are shorter than that
+            {
+                pause = HALTED;
+                break;
+            }
+            converged = pc == static_cast<uint16_t>( ~lowest( ~( address & lanes.live ))); // the highest address
+            lanes.mask = lanes.live & zero( address ^ pc );
+            lanes.waiting = ( lanes.waiting + 1 ) & lanes.live & ~lanes.mask;
+            if(( step & ( DIVERGENCE_CHECK - 1 )) == 0 and any( negative( DIVERGENCE_LIMIT - lanes.waiting )))
+            {
+                pause = DIVERGED;
+                break;
+            }
+        }
+
+        const LaneInstruction& current = code[pc];
+        Words next = address + 1;
+
+        if( current.kind == LANE_JUMP or current.kind == LANE_JUMP_IF )
+        {
+            Words taken = mask;
+            if( current.kind == LANE_JUMP_IF )
+            {
+                Words set = -(( lanes.flags >> current.dest ) & 1 );
+                taken &= current.src ? set : ~set;
+            }
+            address = blend( taken, Words{} + current.value, blend( mask, next, address ));
+            lanes.retired += mask & 1;
+            if( not any( taken ))
+                pc++;
+            else if( any( mask & ~taken )) // the lanes part
+                converged = false;
+            else
+                pc = current.value;
+            continue;
+        }
+
+        LaneKind kind = current.kind;
+        Words src = current.immediate ? Words{} + current.value : lanes.reg[current.src];
+        Words& dest = lanes.reg[current.dest];
+        if(( kind == LANE_MUL or kind == LANE_DIV or kind == LANE_MOD ) and any( mask & zero( src )))
+            kind = LANE_SCALAR; // a null source faults, leave it to the scalar interpreter
+
+        Words result = {};
+        Words overflow = {}; // 0xFFFF where the result overflowed
+        switch( kind )
+        {
+            case LANE_ADD:
+                result = dest + src;
+                overflow = negative(( dest ^ result ) & ( src ^ result ));
+                break;
+            case LANE_SUB:
+            case LANE_CMP:
+                result = dest - src;
+                overflow = negative(( dest ^ src ) & ( dest ^ result ));
+                break;
+            case LANE_MUL:
+            {
+                using Products [[gnu::vector_size( 4 * LANES )]] = int32_t;
+                Products product = __builtin_convertvector( __builtin_convertvector( dest, Signed ), Products ) *
+                                   __builtin_convertvector( __builtin_convertvector( src, Signed ), Products );
+                result = __builtin_convertvector( product, Words );
+                Products truncated = __builtin_convertvector( __builtin_convertvector( result, Signed ), Products );
+                overflow = __builtin_convertvector( __builtin_convertvector( truncated != product, Signed ), Words );
+                break;
+            }
+            case LANE_DIV:
+                for( unsigned i = 0; i < LANES; i++ ) // no vector division, still no decoding per lane
+                    result[i] = mask[i] ? static_cast<uint16_t>( dest[i] / src[i] ) : 0;
+                break;
+            case LANE_MOD:
+                for( unsigned i = 0; i < LANES; i++ )
+                    result[i] = mask[i] ? static_cast<uint16_t>( dest[i] % src[i] ) : 0;
+                break;
+            case LANE_SHR:
+                result = dest >> current.value;
+                break;
+            case LANE_MASK:
+                result = dest & current.value;
+                break;
+            case LANE_COPY:
+                result = src;
+                break;
+            case LANE_AND:
+                result = dest & src;
+                break;
+            case LANE_OR:
+                result = dest | src;
+                break;
+            case LANE_NOT:
+                result = ~src;
+                break;
+            case LANE_XOR:
+                result = dest ^ src;
+                break;
+            default: // LANE_SCALAR
+                pause = SCALAR;
+                break;
+        }
+        if( pause == SCALAR )
+            break;
+
+        // the flags of VM::executeAddBasedOP and VM::executeBinBasedOP, OVF is kept by the others
+        bool arithmetic = kind == LANE_ADD or kind == LANE_SUB or kind == LANE_CMP or kind == LANE_MUL;
+        uint16_t kept = arithmetic ? 0 : OVERFLOW_FLAG;
+        Words null = zero( result );
+        Words below = negative( result );
+        Words flags = ( null & ZERO_FLAGS ) | ( below & NEGATIVE_FLAG ) | ( ~( null | below ) & POSITIVE_FLAG ) |
+                      ( -( result & 1 ) & ODD_FLAG ) | ( overflow & OVERFLOW_FLAG ) | ( lanes.flags & kept );
+        lanes.flags = blend( mask, flags, lanes.flags );
+        if( kind != LANE_CMP )
+            dest = blend( mask, result, dest );
+        address = blend( mask, next, address );
+        lanes.retired += mask & 1;
+        pc++;
+    }
+    totals.vector_steps += step;
+    return pause;
+}
+
+// execute the instruction of the lanes in 'mask' lane by lane in the VMs
+void LockstepEngine::scalarStep( void )
+{
+    for( unsigned lane = 0; lane < LANES; lane++ )
+    {
+        if( not lanes.mask[lane] )
+            continue;
+        VM* vm = vms[lane];
+        store( lane );
+        bool running = vm->execute( 1 );
+        fetch( lane );
+        totals.scalar_instructions++;
+        if( not running ) // HALT
+        {
+            vm->finish();
+            lanes.live[lane] = 0;
+        }
+        else if( vm->interrupts_armed or vm->code_segment != 0 )
+            split( lane );
+    }
+}
+
+// add the instructions executed in vector steps to the VMs
+void LockstepEngine::flushRetired( void )
+{
+    for( unsigned lane = 0; lane < LANES; lane++ )
+    {
+        if( vms[lane] != nullptr )
+            vms[lane]->retired += lanes.retired[lane];
+        totals.lane_instructions += lanes.retired[lane];
+        lanes.retired[lane] = 0;
+    }
+}
+
+// copy the state of a lane to its VM
+void LockstepEngine::store( unsigned lane )
+{
+    VM* vm = vms[lane];
+    for( int r = 0; r < R_COUNT; r++ )
+        vm->reg[r] = lanes.reg[r][lane];
+    for( int f = 0; f < F_COUNT; f++ )
+        vm->flags[f] = ( lanes.flags[lane] >> f ) & 1;
+}
+
+// copy the state of a VM to its lane
+void LockstepEngine::fetch( unsigned lane )
+{
+    VM* vm = vms[lane];
+    for( int r = 0; r < R_COUNT; r++ )
+        lanes.reg[r][lane] = vm->reg[r];
+    lanes.flags[lane] = 0;
+    for( int f = 0; f < F_COUNT; f++ )
+        lanes.flags[lane] = static_cast<uint16_t>( lanes.flags[lane] | ( vm->flags[f] << f ));
+}
+
+// hand a lane to the scalar interpreter
+void LockstepEngine::split( unsigned lane )
+{
+    store( lane );
+    lanes.live[lane] = 0;
+    scalar.push_back( vms[lane] );
+    totals.splits++;
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "basmDefinition.h"
+
+class VM;
+
+
+//  +-------------------------+
+//  |    Lockstep Engine      |
+//  +-------------------------+
+
+// work done by a LockstepEngine
+struct LockstepStats
+{
+    uint64_t vector_steps = 0;          // instructions decoded once and executed for every lane at their address
+    uint64_t lane_instructions = 0;     // instructions executed by lanes in those steps
+    uint64_t scalar_instructions = 0;   // instructions executed lane by lane ( memory, I/O, calls... )
+    uint64_t splits = 0;                // lanes handed back to the scalar interpreter
+};
+
+// runs the same program on up to LANES VMs at once ( SPMD ). The registers and flags of the lanes are
+// stored as vectors of LANES words, and every step executes the instruction at the lowest address of the
+// lanes for the lanes at that address, the others are masked. Lanes that branched apart wait for each
+// other there and run together again once they reach the same address. Arithmetic, logic, comparisons
+// and jumps on registers or immediate values run on the vector types of the compiler ( AVX2 when the
+// host has it, SSE2 otherwise ), other instructions run lane by lane through the VMs. A lane masked for
+// more than DIVERGENCE_LIMIT steps in a row, left alone, or armed for interrupts, finishes in the scalar
+// interpreter
+class LockstepEngine
+{
+public:
+    static const unsigned LANES = 16;
+    // steps a lane may wait for the others before it is split off
+    static const uint16_t DIVERGENCE_LIMIT = 256;
+    // a word per lane, a single register of the host with AVX2
+    using Words [[gnu::vector_size( 2 * LANES )]] = uint16_t;
+
+private:
+    // what a vector step does, decoded once for every address of the program
+    enum LaneKind : uint8_t
+    {
+        LANE_SCALAR,    // run lane by lane through the VMs
+        LANE_ADD,
+        LANE_SUB,
+        LANE_CMP,
+        LANE_MUL,
+        LANE_DIV,
+        LANE_MOD,
+        LANE_SHR,       // DIV by a power of two
+        LANE_MASK,      // MOD by a power of two
+        LANE_COPY,
+        LANE_AND,
+        LANE_OR,
+        LANE_NOT,
+        LANE_XOR,
+        LANE_JUMP,
+        LANE_JUMP_IF
+    };
+
+    struct LaneInstruction
+    {
+        LaneKind kind = LANE_SCALAR;
+        uint8_t dest = 0;               // destination register | flag tested by LANE_JUMP_IF
+        uint8_t src = 0;                // source register | flag value taking LANE_JUMP_IF
+        bool immediate = false;         // the source is 'value'
+        uint16_t value = 0;             // immediate value | jump target | shift
+    };
+
+    // why laneSteps() stopped
+    enum Pause
+    {
+        HALTED,         // no lane left in lockstep
+        SCALAR,         // the lanes of 'mask' are at an instruction run lane by lane
+        DIVERGED,       // a lane waited more than DIVERGENCE_LIMIT steps
+        BUDGET          // the counters in 'retired' must be flushed
+    };
+
+    // state of the lanes, structure of arrays
+    struct Lanes
+    {
+        Words reg[R_COUNT];
+        Words flags;                    // bit f is flag f
+        Words live;                     // 0xFFFF for lanes running in lockstep, 0 otherwise
+        Words mask;                     // 0xFFFF for live lanes at the address of the current step
+        Words waiting;                  // steps a live lane was masked in a row
+        Words retired;                  // instructions executed in vector steps, not added to the VM yet
+    };
+
+    Lanes lanes;
+    VM* vms[LANES];
+    std::vector<LaneInstruction> decoded;
+    std::vector<VM*> scalar;            // lanes split off, finished by the scalar interpreter
+    LockstepStats totals;
+
+public:
+    // run every VM until its program halts, LANES at a time. The VMs are loaded with the same program
+    // and stopped, each with its own memory, console and registers, ex: a parameter sweep
+    void run( const std::vector<VM*>& machines );
+
+    const LockstepStats& stats( void ) const { return totals; }
+
+private:
+    // run up to LANES VMs in lockstep, then finish the lanes split off
+    void runGroup( VM* const* machines, unsigned count );
+
+    // fill 'decoded' from the program
+    void decode( const std::vector<uint32_t>& code );
+
+    // vector steps until an instruction must run lane by lane, a lane diverged or every lane halted
+    Pause laneSteps( void );
+
+    // execute the instruction of the lanes in 'mask' lane by lane in the VMs
+    void scalarStep( void );
+
+    // add the instructions executed in vector steps to the VMs
+    void flushRetired( void );
+
+    // copy the state of a lane to its VM, or back
+    void store( unsigned lane );
+    void fetch( unsigned lane );
+
+    // hand a lane to the scalar interpreter
+    void split( unsigned lane );
+};
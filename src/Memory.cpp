@@ -0,0 +1,333 @@
+#include <algorithm>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Memory.h"
+#include "misc.h"
+
+
+// reserve the guest address space
+static uint16_t* reserveAddressSpace( int protection )
+{
+    void* region = mmap( nullptr, GuestMemory::SIZE * sizeof( uint16_t ), protection,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+    if( region == MAP_FAILED )
+        Error( "Cannot reserve the guest address space" );
+    return static_cast<uint16_t*>( region );
+}
+
+// page table entries of the address space, empty if the host does not expose them
+static std::vector<uint64_t> readPagemap( const uint16_t* words )
+{
+    const size_t page_bytes = GuestMemory::pageWords() * sizeof( uint16_t );
+    const size_t pages = GuestMemory::SIZE * sizeof( uint16_t ) / page_bytes;
+    std::vector<uint64_t> entries( pages );
+
+    int pagemap = open( "/proc/self/pagemap", O_RDONLY | O_CLOEXEC );
+    if( pagemap < 0 )
+        return {};
+    off_t offset = static_cast<off_t>( reinterpret_cast<uintptr_t>( words ) / page_bytes * sizeof( uint64_t ));
+    if( pread( pagemap, entries.data(), pages * sizeof( uint64_t ), offset ) != static_cast<ssize_t>( pages * sizeof( uint64_t )))
+        entries.clear();
+    close( pagemap );
+    return entries;
+}
+
+static const uint64_t PAGE_PRESENT   = 1ull << 63;
+static const uint64_t PAGE_FILE      = 1ull << 61;  // file or shared memory, not a private copy
+static const uint64_t PAGE_EXCLUSIVE = 1ull << 56;  // mapped once
+
+// flat memory, zero initialized, pages are only committed when touched
+GuestMemory::GuestMemory( Backend backend )
+{
+    if( backend == ZERO_PAGE ) // the anonymous reservation is the memory itself
+    {
+        words = reserveAddressSpace( PROT_READ | PROT_WRITE );
+        return;
+    }
+
+    const size_t bytes = SIZE * sizeof( uint16_t );
+    memory_fd = memfd_create( "basal-memory", MFD_CLOEXEC );
+    if( memory_fd < 0 or ftruncate( memory_fd, static_cast<off_t>( bytes )) != 0 )
+        Error( "Cannot allocate the guest memory" );
+
+    words = reserveAddressSpace( PROT_NONE );
+    if( mmap( words, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memory_fd, 0 ) != words )
+        Error( "Cannot map the guest memory" );
+}
+
+// paged memory with 'banks' physical banks of WINDOW_WORDS words ( at least WINDOW_COUNT )
+GuestMemory::GuestMemory( uint32_t banks )
+: bank_count( banks )
+, bank_table( WINDOW_COUNT, UINT32_MAX )   // nothing mapped yet
+{
+    if( banks < WINDOW_COUNT )
+        Error( "Paged memory needs at least " + std::to_string( WINDOW_COUNT ) + " banks" );
+
+    // physical memory : a sparse file in RAM, only the banks touched are committed
+    bank_fd = memfd_create( "basal-banks", MFD_CLOEXEC );
+    if( bank_fd < 0 or ftruncate( bank_fd, static_cast<off_t>( banks ) * WINDOW_WORDS * sizeof( uint16_t )) != 0 )
+        Error( "Cannot allocate " + std::to_string( banks ) + " memory banks" );
+
+    // reserve the address space, then map every window on its bank
+    words = reserveAddressSpace( PROT_NONE );
+
+    for( uint8_t window = 0; window < WINDOW_COUNT; window++ )
+        mapBank( window, window );
+}
+
+GuestMemory::~GuestMemory()
+{
+    munmap( words, SIZE * sizeof( uint16_t )); // also unmap the files, writable ones are written back by the OS
+    if( isPaged() )
+        close( bank_fd );
+    if( memory_fd >= 0 )
+        close( memory_fd );
+}
+
+// map a physical bank onto a window of the address space
+void GuestMemory::mapBank( uint8_t window, uint32_t bank )
+{
+    if( not isPaged() )
+        Error( "Cannot switch banks, memory is not paged ( see --banks )" );
+    if( window >= WINDOW_COUNT or bank >= bank_count )
+        Error( "Bank " + std::to_string( bank ) + " does not exist" );
+
+    std::lock_guard<std::mutex> lock( table_mutex );
+    if( bank_table[window] == bank ) // already mapped, nothing to do
+        return;
+
+    const size_t window_bytes = WINDOW_WORDS * sizeof( uint16_t );
+    void* target = words + window * WINDOW_WORDS;
+    void* mapped = mmap( target, window_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                         bank_fd, static_cast<off_t>( bank ) * static_cast<off_t>( window_bytes ));
+    if( mapped != target )
+        Error( "Cannot map bank " + std::to_string( bank ));
+    bank_table[window] = bank;
+}
+
+// physical bank currently mapped onto a window
+uint32_t GuestMemory::windowBank( uint8_t window )
+{
+    std::lock_guard<std::mutex> lock( table_mutex );
+    return bank_table[window];
+}
+
+// words in a host page, the granularity of mapFile
+uint32_t GuestMemory::pageWords( void )
+{
+    static const uint32_t page_words = static_cast<uint32_t>( sysconf( _SC_PAGESIZE )) / sizeof( uint16_t );
+    return page_words;
+}
+
+// map a host file, read as 16 bits words in host byte order, onto the address space from 'address'
+uint32_t GuestMemory::mapFile( const std::string& path, uint16_t address, bool writable )
+{
+    if( address % pageWords() != 0 )
+        Error( "Cannot map '" + path + "' at address " + std::to_string( static_cast<unsigned>( address ))
+               + ", it must be a multiple of " + std::to_string( pageWords() ));
+
+    int fd = open( path.c_str(), ( writable ? O_RDWR : O_RDONLY ) | O_CLOEXEC );
+    struct stat info;
+    if( fd < 0 or fstat( fd, &info ) != 0 )
+        Error( "Cannot open file '" + path + "'" );
+
+    // only map whole pages backed by the file : touching a page past its end would be fatal
+    size_t bytes = std::min<size_t>( static_cast<size_t>( info.st_size ), ( SIZE - address ) * sizeof( uint16_t ));
+    if( bytes == 0 )
+        Error( "Cannot map empty file '" + path + "'" );
+
+    void* target = words + address;
+    void* mapped = mmap( target, bytes, PROT_READ | PROT_WRITE, ( writable ? MAP_SHARED : MAP_PRIVATE ) | MAP_FIXED, fd, 0 );
+    close( fd ); // the mapping keeps the file alive
+    if( mapped != target )
+        Error( "Cannot map file '" + path + "'" );
+    has_file_maps = true;
+
+    if( isPaged() ) // the windows covered no longer show their bank
+    {
+        std::lock_guard<std::mutex> lock( table_mutex );
+        for( size_t w = address / WINDOW_WORDS; w * WINDOW_WORDS < address + bytes / sizeof( uint16_t ); w++ )
+            bank_table[w] = UINT32_MAX;
+    }
+    return static_cast<uint32_t>(( bytes + 1 ) / sizeof( uint16_t ));
+}
+
+// host memory committed for this address space
+size_t GuestMemory::residentBytes( void ) const
+{
+    size_t bytes = 0;
+
+    // pages of the memory file, or of the banks, whether they are mapped or not
+    struct stat info;
+    int owned = isPaged() ? bank_fd : memory_fd;
+    if( owned >= 0 and not copy_on_write and fstat( owned, &info ) == 0 )
+        bytes += static_cast<size_t>( info.st_blocks ) * 512;
+
+    // anonymous pages present and mapped by this address space only, the zero page is not
+    for( uint64_t entry : readPagemap( words ))
+        if(( entry & PAGE_PRESENT ) and ( entry & PAGE_EXCLUSIVE ) and not ( entry & PAGE_FILE ))
+            bytes += pageWords() * sizeof( uint16_t );
+    return bytes;
+}
+
+// a new address space with the same content, sharing its pages copy-on-write with this one
+std::shared_ptr<GuestMemory> GuestMemory::fork( void )
+{
+    if( isPaged() or has_file_maps )
+        Error( "Cannot fork a paged memory, or a memory with mapped files" );
+
+    freeze();
+    auto child = std::make_shared<GuestMemory>( ZERO_PAGE );
+    child->memory_fd = dup( memory_fd );
+    if( child->memory_fd < 0 )
+        Error( "Cannot fork the guest memory" );
+    child->copy_on_write = true;
+    child->image_offset = image_offset;
+    child->mapImage();
+    return child;
+}
+
+// make the current content the one restored by revert()
+void GuestMemory::checkpoint( void )
+{
+    if( isPaged() or has_file_maps )
+        Error( "Cannot reset a paged memory, or a memory with mapped files" );
+    freeze();
+}
+
+// drop the pages written since checkpoint(), they read again as they were in the image
+uint32_t GuestMemory::revert( void )
+{
+    if( not copy_on_write )
+        Error( "Cannot reset a memory without checkpoint" );
+
+    const size_t page_bytes = pageWords() * sizeof( uint16_t );
+    std::vector<uint64_t> entries = readPagemap( words );
+    if( entries.empty() ) // written pages cannot be told apart : drop them all
+    {
+        madvise( words, SIZE * sizeof( uint16_t ), MADV_DONTNEED );
+        return static_cast<uint32_t>( SIZE * sizeof( uint16_t ) / page_bytes );
+    }
+
+    // private copies are the pages written, drop them run by run
+    uint32_t reverted = 0;
+    size_t page = 0;
+    while( page < entries.size() )
+    {
+        auto written = [&entries]( size_t p ) { return ( entries[p] & PAGE_PRESENT ) and not ( entries[p] & PAGE_FILE ); };
+        if( not written( page ))
+        {
+            page++;
+            continue;
+        }
+        size_t first = page;
+        while( page < entries.size() and written( page ))
+            page++;
+        madvise( words + first * pageWords(), ( page - first ) * page_bytes, MADV_DONTNEED );
+        reverted += static_cast<uint32_t>( page - first );
+    }
+    return reverted;
+}
+
+// turn the current content into an image shared by forks, that this memory maps copy-on-write
+void GuestMemory::freeze( void )
+{
+    const size_t bytes = SIZE * sizeof( uint16_t );
+    const size_t page_bytes = pageWords() * sizeof( uint16_t );
+
+    // the memory file is the content : stop writing to it
+    if( memory_fd >= 0 and not copy_on_write )
+    {
+        copy_on_write = true;
+        mapImage();
+        return;
+    }
+
+    // pages written since the image was made ( every page if they cannot be told apart )
+    std::vector<uint64_t> entries = readPagemap( words );
+    std::vector<bool> written( bytes / page_bytes, entries.empty() );
+    for( size_t page = 0; page < entries.size(); page++ )
+        written[page] = ( entries[page] & PAGE_PRESENT ) and ( entries[page] & PAGE_EXCLUSIVE ) and not ( entries[page] & PAGE_FILE );
+
+    if( memory_fd >= 0 and std::find( written.begin(), written.end(), true ) == written.end() )
+        return; // the image is up to date, typically forked again right away
+
+    int image = memfd_create( "basal-image", MFD_CLOEXEC );
+    if( image < 0 or ftruncate( image, static_cast<off_t>( bytes )) != 0 )
+        Error( "Cannot allocate the guest memory image" );
+
+    // start from the previous image, copying only its committed pages
+    const off_t end = image_offset + static_cast<off_t>( bytes );
+    off_t data = memory_fd >= 0 ? lseek( memory_fd, image_offset, SEEK_DATA ) : -1;
+    while( data >= 0 and data < end )
+    {
+        off_t hole = std::min( lseek( memory_fd, data, SEEK_HOLE ), end );
+        off_t out = data - image_offset;
+        size_t length = static_cast<size_t>( hole - data );
+        if( copy_file_range( memory_fd, &data, image, &out, length, 0 ) != static_cast<ssize_t>( length ))
+            Error( "Cannot copy the guest memory image" );
+        data = lseek( memory_fd, hole, SEEK_DATA );
+    }
+
+    // then apply the pages written privately
+    for( size_t page = 0; page < written.size(); page++ )
+    {
+        off_t offset = static_cast<off_t>( page * page_bytes );
+        if( written[page] and pwrite( image, words + page * pageWords(), page_bytes, offset ) != static_cast<ssize_t>( page_bytes ))
+            Error( "Cannot write the guest memory image" );
+    }
+
+    if( memory_fd >= 0 )
+        close( memory_fd );
+    memory_fd = image;
+    image_offset = 0;
+    copy_on_write = true;
+    mapImage();
+}
+
+// map the image privately over the address space
+void GuestMemory::mapImage( void )
+{
+    if( mmap( words, SIZE * sizeof( uint16_t ), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, memory_fd, image_offset ) != words )
+        Error( "Cannot map the guest memory image" );
+}
+
+// write the content to a file from 'offset', pages of zeros are left as holes
+bool GuestMemory::writeImage( int fd, off_t offset ) const
+{
+    const size_t bytes = SIZE * sizeof( uint16_t );
+    const uint32_t page_words = pageWords();
+
+    if( ftruncate( fd, offset + static_cast<off_t>( bytes )) != 0 )
+        return false;
+    for( uint32_t page = 0; page < SIZE; page += page_words )
+    {
+        const uint16_t* first = words + page;
+        off_t position = offset + static_cast<off_t>( page * sizeof( uint16_t ));
+        off_t in_file = static_cast<off_t>( page * sizeof( uint16_t ));
+        if( memory_fd >= 0 and not copy_on_write and lseek( memory_fd, in_file, SEEK_DATA ) != in_file )
+            continue; // never touched, reading it would commit it
+        if( std::all_of( first, first + page_words, []( uint16_t word ) { return word == 0; } ))
+            continue;
+        if( pwrite( fd, first, page_words * sizeof( uint16_t ), position ) != static_cast<ssize_t>( page_words * sizeof( uint16_t )))
+            return false;
+    }
+    return true;
+}
+
+// flat memory mapping privately the image written by writeImage, pages are read when touched
+std::shared_ptr<GuestMemory> GuestMemory::fromImage( int fd, off_t offset )
+{
+    auto memory = std::make_shared<GuestMemory>( ZERO_PAGE );
+    memory->memory_fd = dup( fd );
+    if( memory->memory_fd < 0 )
+        Error( "Cannot map the guest memory image" );
+    memory->copy_on_write = true;
+    memory->image_offset = offset;
+    memory->mapImage();
+    return memory;
+}
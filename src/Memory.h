@@ -0,0 +1,105 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <sys/types.h>
+
+
+//  +----------------------+
+//  |    Guest Memory      |
+//  +----------------------+
+
+// the 16 bits address space of a VM, either flat, or paged : in paged mode every window of the
+// address space is backed by a physical bank chosen by BANK, the host page table being the MMU
+// in both modes the address space is only reserved, host memory is committed page by page when touched
+class GuestMemory
+{
+public:
+    static const uint32_t SIZE = 65536;                         // words of the guest address space
+    static const uint32_t WINDOW_WORDS = 4096;                  // words mapped by one bank register
+    static const uint32_t WINDOW_COUNT = SIZE / WINDOW_WORDS;   // bank registers
+
+    // host memory behind a flat address space
+    enum Backend
+    {
+        LAZY,       // a file in RAM ( memfd ), a page is committed the first time it is read or written
+        ZERO_PAGE,  // anonymous memory, untouched and read-only pages share the zero page of the host, no file
+    };              // descriptor until fork() or checkpoint() makes an image
+
+private:
+    uint16_t* words = nullptr;      // the address space seen by the guest, reserved with mmap
+    int memory_fd = -1;             // file behind the flat memory of the LAZY backend, or image shared by forks
+    bool copy_on_write = false;     // memory_fd is a frozen image, mapped privately
+    off_t image_offset = 0;         // position of the image in memory_fd ( snapshot files )
+    bool has_file_maps = false;
+    int bank_fd = -1;               // physical memory of the paged mode
+    uint32_t bank_count = 0;
+    std::vector<uint32_t> bank_table;   // physical bank mapped by each window
+    std::mutex table_mutex;
+
+public:
+    // flat memory, zero initialized, pages are only committed when touched
+    explicit GuestMemory( Backend backend = ZERO_PAGE );
+
+    // paged memory with 'banks' physical banks of WINDOW_WORDS words ( at least WINDOW_COUNT )
+    // window i starts mapped on bank i, so a program that never switches banks sees a flat memory
+    explicit GuestMemory( uint32_t banks );
+
+    ~GuestMemory();
+
+    GuestMemory( const GuestMemory& ) = delete;
+    GuestMemory& operator=( const GuestMemory& ) = delete;
+
+    uint16_t* data( void ) { return words; }
+
+    bool isPaged( void ) const { return bank_fd >= 0; }
+
+    uint32_t bankCount( void ) const { return bank_count; }
+
+    // map a physical bank onto a window of the address space
+    void mapBank( uint8_t window, uint32_t bank );
+
+    // physical bank currently mapped onto a window
+    uint32_t windowBank( uint8_t window );
+
+    // map a host file, read as 16 bits words in host byte order, onto the address space from 'address'
+    // 'address' must be a multiple of pageWords(). Writable : guest writes go to the file.
+    // Otherwise guest writes stay private to the VM. Return the amount of words mapped.
+    uint32_t mapFile( const std::string& path, uint16_t address, bool writable );
+
+    // words in a host page, the granularity of mapFile
+    static uint32_t pageWords( void );
+
+    // host memory committed for this address space : pages of the memory file or of the banks,
+    // plus private pages of this process ( zero page backend, copies made on write ).
+    // Pages shared with another mapping, like the zero page, mapped files or the image shared
+    // with forks, are not counted
+    size_t residentBytes( void ) const;
+
+    // a new address space with the same content, sharing its pages copy-on-write with this one
+    // flat memory only, without mapped files. Both memories must not be written during the call
+    std::shared_ptr<GuestMemory> fork( void );
+
+    // write the content to a file from 'offset', pages of zeros are left as holes. Return false on failure
+    bool writeImage( int fd, off_t offset ) const;
+
+    // flat memory mapping privately the image written by writeImage, pages are read when touched
+    static std::shared_ptr<GuestMemory> fromImage( int fd, off_t offset );
+
+    // make the current content the one restored by revert(), flat memory only, without mapped files
+    // fork() also moves that point when pages were written since
+    void checkpoint( void );
+
+    // drop the pages written since checkpoint(), they read again as they were. Return the amount of pages
+    uint32_t revert( void );
+
+private:
+    // turn the current content into an image shared by forks, that this memory maps copy-on-write
+    void freeze( void );
+
+    // map the image privately over the address space
+    void mapImage( void );
+};
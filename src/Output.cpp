@@ -0,0 +1,274 @@
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Output.h"
+
+
+// buffers alive, flushed by exit()
+static std::mutex registry_mutex;
+static std::vector<OutputBuffer*> registry;
+
+static void flushRegistry( void )
+{
+    std::lock_guard<std::mutex> lock( registry_mutex );
+    for( OutputBuffer* output : registry )
+    {
+        output->flush();
+        output->stopWriter();
+    }
+}
+
+OutputBuffer::OutputBuffer( std::shared_ptr<IOBackend> io )
+: backend( std::move( io ))
+, terminal( backend->isTerminal() )
+{
+    [[maybe_unused]] static const bool registered = ( std::atexit( flushRegistry ) == 0 );
+
+    std::lock_guard<std::mutex> lock( registry_mutex );
+    registry.push_back( this );
+}
+
+OutputBuffer::~OutputBuffer()
+{
+    flush();
+    stopWriter();
+    std::lock_guard<std::mutex> lock( registry_mutex );
+    registry.erase( std::find( registry.begin(), registry.end(), this ));
+}
+
+// append text
+void OutputBuffer::write( std::string_view text )
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    append( text.data(), text.size() );
+}
+
+// append the low byte of every word until a 0 word, or until 'count' words
+void OutputBuffer::writeWords( const uint16_t* words, size_t count )
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    reserve();
+    for( size_t i = 0; i < count and words[i] != 0; i++ )
+    {
+        if( renderer != nullptr )
+        {
+            char c = static_cast<char>( words[i] );
+            renderer->write( &c, 1 );
+            continue;
+        }
+        if( used == CAPACITY )
+            drain();
+        buffer[used++] = static_cast<char>( words[i] );
+    }
+}
+
+// append a number in base 10 or 16 ( upper case ), without leading zeros
+void OutputBuffer::writeNumber( int32_t value, int base )
+{
+    char digits[16];
+    char* end = std::to_chars( digits, digits + sizeof( digits ), value, base ).ptr;
+    if( base == 16 )
+        std::transform( digits, end, digits, []( char c ) { return c >= 'a' ? static_cast<char>( c - 'a' + 'A' ) : c; } );
+
+    std::lock_guard<std::mutex> lock( mutex );
+    append( digits, static_cast<size_t>( end - digits ));
+}
+
+// append the 16 binary digits of a word
+void OutputBuffer::writeBinary( uint16_t value )
+{
+    char digits[16];
+    for( int bit = 0; bit < 16; bit++ )
+        digits[bit] = ( value & ( 0x8000 >> bit )) ? '1' : '0';
+
+    std::lock_guard<std::mutex> lock( mutex );
+    append( digits, sizeof( digits ));
+}
+
+// hand the buffered text to the backend, on a terminal show the frame drawn so far
+void OutputBuffer::flush( void )
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    drain();
+}
+
+// write text right away, after the buffered text and bypassing the frame of CLS
+void OutputBuffer::writeNow( std::string_view text )
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    drain();
+    std::cout.flush();
+    emit( text.data(), text.size() );
+    if( renderer != nullptr ) // the cursor moved
+        renderer->invalidate();
+}
+
+// the terminal changed behind the output, the next frame is drawn from scratch
+void OutputBuffer::invalidate( void )
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    if( renderer != nullptr )
+        renderer->invalidate();
+}
+
+// asynchronous mode : flushes hand the text to a writer thread through a ring
+void OutputBuffer::startWriter( void )
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    if( writer.joinable() )
+        return;
+    drain(); // text flushed before stays before
+    ring = std::make_unique<ByteRing>( RING_CAPACITY );
+    stopping.store( false );
+    writer = std::thread( &OutputBuffer::writerLoop, this );
+}
+
+// flush, wait for the writer to write everything and join it, back to synchronous mode
+void OutputBuffer::stopWriter( void )
+{
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        if( not writer.joinable() )
+            return;
+        drain();
+        stopping.store( true, std::memory_order_release );
+        pushed.fetch_add( 1, std::memory_order_release );
+        pushed.notify_one();
+    }
+    writer.join();
+    std::lock_guard<std::mutex> lock( mutex );
+    ring.reset();
+}
+
+// CLS : on a terminal, show the frame drawn since the previous CLS and start a new one
+void OutputBuffer::clearScreen( void )
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    drain();
+    if( not terminal )
+        return;
+    if( renderer == nullptr ) // text written before the first CLS stays plain text
+    {
+        renderer = std::make_unique<TerminalRenderer>();
+        drain(); // clear the terminal
+    }
+    else
+        renderer->clear(); // the terminal shows the previous frame until the next flush
+}
+
+// host memory held by the buffer and the ring, in bytes
+size_t OutputBuffer::footprint( void ) const
+{
+    return sizeof( OutputBuffer ) + ( buffer != nullptr ? CAPACITY : 0 ) + ( ring != nullptr ? RING_CAPACITY : 0 );
+}
+
+// allocate the buffer on the first write
+void OutputBuffer::reserve( void )
+{
+    if( buffer == nullptr )
+        buffer = std::make_unique_for_overwrite<char[]>( CAPACITY );
+}
+
+// append without locking, flushing first if there is no room left
+void OutputBuffer::append( const char* text, size_t length )
+{
+    if( renderer != nullptr ) // the frame is the buffer
+    {
+        renderer->write( text, length );
+        return;
+    }
+    reserve();
+    while( length > 0 )
+    {
+        if( used == CAPACITY )
+            drain();
+        size_t chunk = std::min( length, CAPACITY - used );
+        std::copy( text, text + chunk, buffer.get() + used );
+        used   += chunk;
+        text   += chunk;
+        length -= chunk;
+    }
+}
+
+// write the buffered text without locking
+void OutputBuffer::drain( void )
+{
+    if( renderer != nullptr )
+    {
+        std::string changes;
+        size_t rows, columns;
+        if( backend->windowSize( rows, columns ) and not renderer->fits( rows, columns ))
+        {
+            // cursor moves would be clamped by the window : scroll as plain text until the next CLS
+            renderer->stream( changes );
+            renderer.reset();
+        }
+        else
+            renderer->render( changes );
+        emit( changes.data(), changes.size() );
+        return;
+    }
+    if( used == 0 )
+        return;
+    std::cout.flush(); // text of the host printed before stays before
+    emit( buffer.get(), used );
+    used = 0;
+}
+
+// hand text to the backend, or to the writer in asynchronous mode
+void OutputBuffer::emit( const char* text, size_t length )
+{
+    if( ring == nullptr )
+    {
+        backend->write( text, length );
+        return;
+    }
+    unsigned spins = 0;
+    while( length > 0 )
+    {
+        uint32_t seen = consumed.load( std::memory_order_acquire );
+        size_t pushed_length = ring->push( text, length );
+        text   += pushed_length;
+        length -= pushed_length;
+        if( pushed_length > 0 )
+        {
+            pushed.fetch_add( 1, std::memory_order_release );
+            pushed.notify_one();
+            spins = 0;
+        }
+        else if( ++spins < 64 ) // full : the writer is probably emptying it right now
+            std::atomic_signal_fence( std::memory_order_seq_cst );
+        else
+            consumed.wait( seen, std::memory_order_acquire );
+    }
+}
+
+// body of the writer thread : write what enters the ring until stopWriter()
+void OutputBuffer::writerLoop( void )
+{
+    while( true )
+    {
+        // read before the ring : text pushed before stopping is seen by peek(), and a push
+        // or a stop coming after changes 'seen', so the wait below cannot miss it
+        uint32_t seen = pushed.load( std::memory_order_acquire );
+        bool stop = stopping.load( std::memory_order_acquire );
+        size_t length;
+        const char* text = ring->peek( length );
+        if( length > 0 )
+        {
+            backend->write( text, length );
+            ring->consume( length );
+            consumed.fetch_add( 1, std::memory_order_release );
+            consumed.notify_one();
+        }
+        else if( stop )
+            return;
+        else
+            pushed.wait( seen, std::memory_order_acquire );
+    }
+}
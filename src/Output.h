@@ -0,0 +1,105 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+
+#include "IO.h"
+#include "Ring.h"
+#include "Terminal.h"
+
+
+//  +----------------------+
+//  |    Output Buffer     |
+//  +----------------------+
+
+// output of DISP : text is formatted straight into a buffer, handed to the I/O backend in one
+// call when the buffer is full or when flush() is called. Shared by the threads of a VM.
+// After a CLS on a terminal, text goes to a TerminalRenderer instead, see clearScreen(), as long as
+// the frame fits in the terminal window
+// In asynchronous mode the flushed text goes through a ring to a writer thread, which alone calls the backend
+// Every buffer still alive is flushed when the process exits, Error() included
+class OutputBuffer
+{
+public:
+    static const size_t CAPACITY = 16384;
+    static const size_t RING_CAPACITY = 1 << 20;    // text flushed but not written yet, asynchronous mode
+
+private:
+    std::shared_ptr<IOBackend> backend;
+    std::unique_ptr<char[]> buffer;     // CAPACITY bytes, allocated by the first write
+    size_t used = 0;
+    std::mutex mutex;
+    bool terminal;      // the backend writes to a terminal, CLS draws frames with the renderer
+    std::unique_ptr<TerminalRenderer> renderer;     // created by the first CLS on a terminal
+    std::unique_ptr<ByteRing> ring;                 // asynchronous mode, between flushes and the writer
+    std::thread writer;
+    std::atomic<uint32_t> pushed{ 0 };              // bumped when text enters the ring, wakes the writer
+    std::atomic<uint32_t> consumed{ 0 };            // bumped when text leaves the ring, wakes a flush waiting for room
+    std::atomic<bool> stopping{ false };
+
+public:
+    explicit OutputBuffer( std::shared_ptr<IOBackend> io );
+    ~OutputBuffer();
+
+    OutputBuffer( const OutputBuffer& ) = delete;
+    OutputBuffer& operator=( const OutputBuffer& ) = delete;
+
+    // append text
+    void write( std::string_view text );
+
+    // append the low byte of every word until a 0 word, or until 'count' words, ex: a guest string
+    void writeWords( const uint16_t* words, size_t count );
+
+    // append a number in base 10 or 16 ( upper case ), without leading zeros
+    void writeNumber( int32_t value, int base = 10 );
+
+    // append the 16 binary digits of a word
+    void writeBinary( uint16_t value );
+
+    // hand the buffered text to the backend, on a terminal show the frame drawn so far
+    void flush( void );
+
+    // write text right away, after the buffered text and bypassing the frame of CLS
+    void writeNow( std::string_view text );
+
+    // the terminal changed behind the output, ex: echo of INPUT. The next frame is drawn from scratch
+    void invalidate( void );
+
+    bool isTerminal( void ) const { return terminal; }
+
+    // host memory held by the buffer and the ring, in bytes
+    size_t footprint( void ) const;
+
+    // asynchronous mode : flushes hand the text to a writer thread through a ring, the calling thread
+    // makes no write system call. A flush finding the ring full spins briefly, then blocks
+    void startWriter( void );
+
+    // flush, wait for the writer to write everything and join it, back to synchronous mode
+    void stopWriter( void );
+
+    // CLS : on a terminal, show the frame drawn since the previous CLS and start a new one.
+    // Elsewhere only flush, frames follow each other as plain text. A frame growing taller
+    // or wider than the terminal is written as plain text, and so is the text until the next CLS
+    void clearScreen( void );
+
+private:
+    // allocate the buffer on the first write
+    void reserve( void );
+
+    // append without locking, flushing first if there is no room left
+    void append( const char* text, size_t length );
+
+    // write the buffered text without locking
+    void drain( void );
+
+    // hand text to the backend, or to the writer in asynchronous mode
+    void emit( const char* text, size_t length );
+
+    // body of the writer thread : write what enters the ring until stopWriter()
+    void writerLoop( void );
+};
@@ -0,0 +1,48 @@
+#include <algorithm>
+#include <bit>
+
+#include "Ring.h"
+
+
+// capacity is rounded up to a power of two
+ByteRing::ByteRing( size_t capacity )
+: bytes( std::bit_ceil( capacity < 2 ? 2 : capacity ))
+, mask( bytes.size() - 1 )
+{
+}
+
+// producer : copy as many bytes as there is room for, return the amount copied
+size_t ByteRing::push( const char* data, size_t length )
+{
+    size_t write = tail.load( std::memory_order_relaxed );
+    size_t room  = bytes.size() - ( write - head.load( std::memory_order_acquire ));
+    length = std::min( length, room );
+
+    // the free space may wrap around the end of the storage
+    size_t first = std::min( length, bytes.size() - ( write & mask ));
+    std::copy_n( data, first, bytes.data() + ( write & mask ));
+    std::copy_n( data + first, length - first, bytes.data() );
+
+    tail.store( write + length, std::memory_order_release );
+    return length;
+}
+
+// consumer : bytes ready to be read in place, up to the end of the storage
+const char* ByteRing::peek( size_t& length ) const
+{
+    size_t read = head.load( std::memory_order_relaxed );
+    size_t ready = tail.load( std::memory_order_acquire ) - read;
+    length = std::min( ready, bytes.size() - ( read & mask ));
+    return bytes.data() + ( read & mask );
+}
+
+// consumer : release 'length' bytes returned by peek()
+void ByteRing::consume( size_t length )
+{
+    head.store( head.load( std::memory_order_relaxed ) + length, std::memory_order_release );
+}
+
+bool ByteRing::empty( void ) const
+{
+    return head.load( std::memory_order_acquire ) == tail.load( std::memory_order_acquire );
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+
+
+//  +----------------------+
+//  |      Byte Ring       |
+//  +----------------------+
+
+// bounded lock-free queue of bytes between one producer thread and one consumer thread
+// bytes are copied in and out by whole chunks, the consumer reads them in place
+class ByteRing
+{
+private:
+    // keep producer and consumer indexes on different cache lines
+    alignas( 64 ) std::atomic<size_t> tail{ 0 };  // next position to write
+    alignas( 64 ) std::atomic<size_t> head{ 0 };  // next position to read
+    std::vector<char> bytes;
+    size_t mask;
+
+public:
+    // capacity is rounded up to a power of two
+    explicit ByteRing( size_t capacity );
+
+    ByteRing( const ByteRing& ) = delete;
+    ByteRing& operator=( const ByteRing& ) = delete;
+
+    // producer : copy as many bytes as there is room for, return the amount copied
+    size_t push( const char* data, size_t length );
+
+    // consumer : bytes ready to be read in place, up to the end of the storage
+    // 'length' receives their amount, 0 if the ring is empty
+    const char* peek( size_t& length ) const;
+
+    // consumer : release 'length' bytes returned by peek()
+    void consume( size_t length );
+
+    bool empty( void ) const;
+
+    size_t capacity( void ) const { return bytes.size(); }
+};
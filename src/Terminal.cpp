@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <string>
+
+#include "Terminal.h"
+
+
+// append a code point encoded in UTF-8
+static void appendUtf8( std::string& out, char32_t c )
+{
+    if( c < 0x80 )
+        out += static_cast<char>( c );
+    else if( c < 0x800 )
+    {
+        out += static_cast<char>( 0xC0 | ( c >> 6 ));
+        out += static_cast<char>( 0x80 | ( c & 0x3F ));
+    }
+    else if( c < 0x10000 )
+    {
+        out += static_cast<char>( 0xE0 | ( c >> 12 ));
+        out += static_cast<char>( 0x80 | (( c >> 6 ) & 0x3F ));
+        out += static_cast<char>( 0x80 | ( c & 0x3F ));
+    }
+    else
+    {
+        out += static_cast<char>( 0xF0 | ( c >> 18 ));
+        out += static_cast<char>( 0x80 | (( c >> 12 ) & 0x3F ));
+        out += static_cast<char>( 0x80 | (( c >> 6 ) & 0x3F ));
+        out += static_cast<char>( 0x80 | ( c & 0x3F ));
+    }
+}
+
+// draw text at the cursor of the frame, UTF-8 encoded
+void TerminalRenderer::write( const char* text, size_t length )
+{
+    for( size_t i = 0; i < length; i++ )
+    {
+        unsigned char byte = static_cast<unsigned char>( text[i] );
+        if( pending_bytes > 0 and ( byte & 0xC0 ) == 0x80 ) // continuation of a multi bytes character
+        {
+            pending = ( pending << 6 ) | ( byte & 0x3F );
+            if( --pending_bytes == 0 )
+                put( pending );
+            continue;
+        }
+        pending_bytes = 0;
+
+        if     ( byte >= 0xF0 ) { pending = byte & 0x07; pending_bytes = 3; }
+        else if( byte >= 0xE0 ) { pending = byte & 0x0F; pending_bytes = 2; }
+        else if( byte >= 0xC0 ) { pending = byte & 0x1F; pending_bytes = 1; }
+        else if( byte == '\n' )
+        {
+            row++;
+            column = 0;
+        }
+        else if( byte == '\r' )
+            column = 0;
+        else if( byte == '\t' )
+            do put( U' ' ); while( column % 8 != 0 );
+        else if( byte >= 0x20 and byte < 0x7F )
+            put( byte );
+        // other control characters have no cell
+    }
+}
+
+// draw one cell at the cursor of the frame
+void TerminalRenderer::put( char32_t cell )
+{
+    if( frame.size() <= row )
+        frame.resize( row + 1 );
+    std::u32string& line = frame[row];
+    if( line.size() <= column )
+        line.resize( column + 1, U' ' );
+    line[column++] = cell;
+}
+
+// start a new, empty frame
+void TerminalRenderer::clear( void )
+{
+    for( std::u32string& line : frame )
+        line.clear();
+    row = 0;
+    column = 0;
+}
+
+// append to 'out' the escape sequences turning the terminal content into the frame
+void TerminalRenderer::render( std::string& out )
+{
+    if( not started ) // nothing known about the terminal : clear it once
+    {
+        out += "\x1b[H\x1b[2J";
+        screen.clear();
+        terminal_row = 0;
+        terminal_column = 0;
+        started = true;
+    }
+
+    auto moveTo = [&]( size_t r, size_t c )
+    {
+        if( r == terminal_row and c == terminal_column )
+            return;
+        out += "\x1b[" + std::to_string( r + 1 ) + ";" + std::to_string( c + 1 ) + "H";
+        terminal_row = r;
+        terminal_column = c;
+    };
+
+    const std::u32string empty;
+    size_t rows = std::max( screen.size(), frame.size() );
+    for( size_t r = 0; r < rows; r++ )
+    {
+        const std::u32string& now = r < frame.size() ? frame[r] : empty;
+        const std::u32string& old = r < screen.size() ? screen[r] : empty;
+
+        for( size_t c = 0; c < now.size(); c++ )
+        {
+            if( c < old.size() and old[c] == now[c] )
+                continue;
+            moveTo( r, c );
+            appendUtf8( out, now[c] );
+            terminal_column++;
+        }
+        if( old.size() > now.size() ) // the rest of the line is not part of the frame anymore
+        {
+            moveTo( r, now.size() );
+            out += "\x1b[K";
+        }
+    }
+    moveTo( row, column ); // text written after the frame goes where the frame stopped
+
+    screen.resize( frame.size() );
+    std::copy( frame.begin(), frame.end(), screen.begin() );
+}
+
+// the frame, cursor included, fits in a terminal of 'rows' rows and 'columns' columns
+bool TerminalRenderer::fits( size_t rows, size_t columns ) const
+{
+    if( std::max( frame.size(), row + 1 ) > rows or column >= columns )
+        return false;
+    return std::all_of( frame.begin(), frame.end(), [columns]( const std::u32string& line ) { return line.size() <= columns; } );
+}
+
+// append to 'out' the frame as plain text after clearing the terminal
+void TerminalRenderer::stream( std::string& out )
+{
+    out += "\x1b[H\x1b[2J";
+    size_t rows = std::max( frame.size(), row + 1 );
+    for( size_t r = 0; r < rows; r++ )
+    {
+        if( r > 0 )
+            out += '\n';
+        if( r < frame.size() )
+            for( char32_t cell : frame[r] )
+                appendUtf8( out, cell );
+    }
+    invalidate();
+}
+
+// the terminal changed behind the renderer, the next render redraws everything
+void TerminalRenderer::invalidate( void )
+{
+    started = false;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+
+//  +-------------------------+
+//  |    Terminal Renderer    |
+//  +-------------------------+
+
+// double buffered terminal : the text written between two CLS is a frame, kept as a grid of cells.
+// Rendering sends the terminal only the cells that differ from the frame it already shows,
+// addressed with ANSI cursor moves, so the cost of a frame follows what changed
+class TerminalRenderer
+{
+private:
+    std::vector<std::u32string> screen;     // cells shown by the terminal, by row
+    std::vector<std::u32string> frame;      // cells of the frame being drawn, by row
+    size_t row = 0;                         // cursor of the frame
+    size_t column = 0;
+    char32_t pending = 0;                   // code point being decoded from UTF-8
+    int pending_bytes = 0;                  // continuation bytes still expected
+    bool started = false;                   // the terminal has been cleared once
+    size_t terminal_row = 0;                // cursor of the terminal
+    size_t terminal_column = 0;
+
+public:
+    // draw text at the cursor of the frame, UTF-8 encoded
+    void write( const char* text, size_t length );
+
+    // start a new, empty frame, the terminal keeps showing the previous one until render()
+    void clear( void );
+
+    // append to 'out' the escape sequences turning the terminal content into the frame
+    void render( std::string& out );
+
+    // the frame, cursor included, fits in a terminal of 'rows' rows and 'columns' columns
+    bool fits( size_t rows, size_t columns ) const;
+
+    // append to 'out' the frame as plain text after clearing the terminal, it scrolls if it is taller
+    void stream( std::string& out );
+
+    // the terminal changed behind the renderer, ex: echo of INPUT. The next render redraws everything
+    void invalidate( void );
+
+private:
+    // draw one cell at the cursor of the frame
+    void put( char32_t cell );
+};
@@ -0,0 +1,97 @@
+#include <algorithm>
+
+#include "ThreadPool.h"
+
+
+// true in threads executing a task, nested jobs are run sequentially to avoid a deadlock
+static thread_local bool inside_task = false;
+
+// start 'workers' host threads, the thread calling run() works too
+ThreadPool::ThreadPool( unsigned workers )
+{
+    for( unsigned i = 0; i < workers; i++ )
+        threads.emplace_back( &ThreadPool::workerLoop, this, i + 1 ); // worker 0 is the caller
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        stopping = true;
+    }
+    wake.notify_all();
+    for( std::thread& t : threads )
+        t.join();
+}
+
+// pool shared by every VM, one thread per core
+ThreadPool& ThreadPool::shared( void )
+{
+    static ThreadPool pool( std::max( 1u, std::thread::hardware_concurrency() ) - 1 );
+    return pool;
+}
+
+// amount of threads taking part in a job, caller included
+unsigned ThreadPool::size( void ) const
+{
+    return static_cast<unsigned>( threads.size() ) + 1;
+}
+
+// call task for every chunk in [0, chunks[ and return once every chunk is done ( barrier )
+void ThreadPool::run( size_t chunks, const Task& task )
+{
+    if( inside_task or threads.empty() ) // nested parallel loop, or nobody to help
+    {
+        for( size_t i = 0; i < chunks; i++ )
+            task( i, 0 );
+        return;
+    }
+
+    std::lock_guard<std::mutex> run_lock( run_mutex );
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        job = &task;
+        job_chunks = chunks;
+        next_chunk.store( 0 );
+        active = static_cast<unsigned>( threads.size() );
+        generation++;
+    }
+    wake.notify_all();
+
+    work( 0 );
+
+    std::unique_lock<std::mutex> lock( mutex );
+    finished.wait( lock, [this]{ return active == 0; } );
+    job = nullptr;
+}
+
+// wait for jobs and take chunks until there is no more
+void ThreadPool::workerLoop( unsigned worker )
+{
+    uint64_t seen = 0;
+    for( ;; )
+    {
+        {
+            std::unique_lock<std::mutex> lock( mutex );
+            wake.wait( lock, [&]{ return stopping or generation != seen; } );
+            if( stopping )
+                return;
+            seen = generation;
+        }
+
+        work( worker );
+
+        std::lock_guard<std::mutex> lock( mutex );
+        if( --active == 0 )
+            finished.notify_one();
+    }
+}
+
+// take chunks of the current job until there is no more
+void ThreadPool::work( unsigned worker )
+{
+    inside_task = true;
+    for( size_t chunk = next_chunk.fetch_add( 1 ); chunk < job_chunks; chunk = next_chunk.fetch_add( 1 ))
+        ( *job )( chunk, worker );
+    inside_task = false;
+}
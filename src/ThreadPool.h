@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+
+//  +-------------------------+
+//  |    Host Thread Pool     |
+//  +-------------------------+
+
+// fixed set of host threads executing the chunks of a parallel loop, used by PFOR
+class ThreadPool
+{
+public:
+    // called for every chunk, worker is in [0, size()[ and unique among the threads running concurrently
+    using Task = std::function<void( size_t chunk, unsigned worker )>;
+
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;       // signal a new job to the workers
+    std::condition_variable finished;   // signal the end of the job to the caller
+    std::mutex run_mutex;               // one job at a time
+
+    const Task* job = nullptr;
+    size_t job_chunks = 0;
+    std::atomic<size_t> next_chunk{ 0 };
+    uint64_t generation = 0;            // incremented for every job
+    unsigned active = 0;                // workers still busy with the current job
+    bool stopping = false;
+
+public:
+    // start 'workers' host threads, the thread calling run() works too
+    explicit ThreadPool( unsigned workers );
+    ~ThreadPool();
+
+    ThreadPool( const ThreadPool& ) = delete;
+    ThreadPool& operator=( const ThreadPool& ) = delete;
+
+    // pool shared by every VM, one thread per core
+    static ThreadPool& shared( void );
+
+    // amount of threads taking part in a job, caller included
+    unsigned size( void ) const;
+
+    // call task for every chunk in [0, chunks[ and return once every chunk is done ( barrier )
+    // when called from a task, chunks are executed sequentially by the calling thread
+    void run( size_t chunks, const Task& task );
+
+private:
+    // wait for jobs and take chunks until there is no more
+    void workerLoop( unsigned worker );
+
+    // take chunks of the current job until there is no more
+    void work( unsigned worker );
+};
@@ -1,19 +1,26 @@
 #include <iostream>
 #include <string>
-#include <time.h> // used for seeding PRNG with entropy
+#include <random> // used for seeding PRNG with entropy
 #include <chrono> // used for cross platform sleep call
 #include <thread>
 #include <vector>
 #include <bitset> // used for binary display of number
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "misc.h"
 #include "VM.h"
+#include "ThreadPool.h"
 #include "lexer.h"
 
 using std::string;
 using std::cout;
 using std::endl;
-using std::cin;
 using std::flush;
 
 // take the intruction code from the instruction
@@ -67,6 +74,24 @@ uint16_t parseInputValue( string value )
 
 
 
+// seed of a new VM : host entropy mixed with a counter and the clock, so VMs created at the same
+// time, by any thread, get different sequences. Never 0, xorshift would be stuck
+static uint16_t entropySeed( void )
+{
+    static std::atomic<uint64_t> created{ 0 };
+    thread_local std::random_device device;     // one per thread, calls on the same object could race
+    uint64_t x = ( static_cast<uint64_t>( device() ) << 32 )
+               ^ static_cast<uint64_t>( std::chrono::steady_clock::now().time_since_epoch().count() )
+               ^ ( created.fetch_add( 1, std::memory_order_relaxed ) * 0x9E3779B97F4A7C15ull );
+    x ^= x >> 33; // finalizer of MurmurHash3 : every bit of the input reaches the 16 kept
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33;
+    uint16_t seed = static_cast<uint16_t>( x ^ ( x >> 16 ) ^ ( x >> 32 ) ^ ( x >> 48 ));
+    return seed == 0 ? 1 : seed;
+}
+
+
+
 //  +--------------------------+
 //  |    VM basic functions    |
 //  +--------------------------+
@@ -80,28 +105,188 @@ void VM::initialize( void )
     }
     // push will increment reg[sp] before assignement
     reg[sp] = RESERVED_SPACE; // save space for flags
+    stack_start = reg[sp];
     reg[ip] = 0;
+    code_segment = 0;
+
+    memory_block = std::make_shared<GuestMemory>();     // flat and zero initialized, no file descriptor
+    memory = memory_block->data();
+    program = std::make_shared<const std::vector<uint32_t>>(); // clear current program
+    io = std::make_shared<TerminalBackend>();
+    output = std::make_shared<OutputBuffer>( io );
+
+    rnd_seed = entropySeed();   // seed the xorshift PRNG
+
+    natives.fill( nullptr );
+    registerNative( NATIVE_SORT, natives::memorySort );
+    registerNative( NATIVE_ITOA, natives::intToString );
+
+    heap = Heap();  // no heap until configureHeap or the first ALLOC
+    data_start = data_end = 0;
+    updateStackLimit();
+    channels.fill( nullptr );
+
+    vectors.fill( NO_VECTOR );
+    interrupts_enabled = true;
+    timer_period = std::chrono::steady_clock::duration::zero();
+    updateInterruptSources();
+
+    retired = 0;
+    clock_origin = std::chrono::steady_clock::now();
+    skipped = std::chrono::steady_clock::duration::zero();
+    regions.clear(); // allocated when profiling is enabled
+    if( profiling )
+        regions.assign( 256, ProfileRegion() );
+}
 
-    program.clear();     // clear current program (currently not usefull)
-
-    srand(time(NULL));
-    rnd_seed = rand();   // seed the xorshift PRNG
+// CYCLES reads the count in the middle of a dispatch loop, which must then count every instruction
+static bool containsCycles( const std::vector<uint32_t>& code )
+{
+    return std::any_of( code.begin(), code.end(), []( uint32_t word ) { return ( word >> 20 ) == 0x040; } );
 }
 
 // load instructions in program vector from another vector (passed by the compiler)
-void VM::load( const std::vector<uint32_t>& instructionArray )
+// and copy the initialized data, if any, in memory from data_base
+void VM::load( const std::vector<uint32_t>& instructionArray, uint16_t data_base, const std::vector<uint16_t>& data )
+{
+    load( std::make_shared<const std::vector<uint32_t>>( instructionArray ), data_base, data ); // copy every element from the vector
+}
+
+// same, sharing a program with other VMs instead of copying it
+void VM::load( std::shared_ptr<const std::vector<uint32_t>> instructions, uint16_t data_base, const std::vector<uint16_t>& data )
 {
-    program = instructionArray; // should copy every element from the vector, works differently than standard array pointer
+    program = std::move( instructions );
+    wide_calls = program->size() > 65536;
+    reads_counter = containsCycles( *program );
+
+    if( data_base + data.size() > GuestMemory::SIZE )
+        Error( "Initialized data does not fit in the memory" );
+    std::copy( data.begin(), data.end(), memory + data_base ); // one block, no instruction needed
+    data_start = data_base;
+    data_end   = data_base + static_cast<uint32_t>( data.size() );
+    checkLayout();
+    updateStackLimit();
 }
 
 // execute the program // TODO use ip register instead of a for loop
 void VM::start( void )
 {
-    while( processInstruction( program[reg[ip]] ))
-    { 
-        // dispMemoryStackLight();
-        // cout << std::hex << std::uppercase <<  program[reg[ip]] << std::dec << endl; 
-    } 
+    if( root == nullptr and async_output )
+        output->startWriter();
+    execute( UINT64_MAX );
+    finish();
+}
+
+// execute at most 'budget' instructions without ever blocking the host thread
+VM::RunState VM::run( uint64_t budget )
+{
+    if( root == nullptr and async_output )
+        output->startWriter();
+    if( suspension == WAITING_THREAD and waiting_thread == nullptr ) // halted, waiting for its threads
+    {
+        if( not threadsFinished() )
+            return SUSPENDED;
+        suspension = RUNNING;
+        finish();
+        return HALTED;
+    }
+    cooperative = true;
+    if( suspension == IDLING ) // step past the IDLE only if an interrupt is delivered, the handler returns after it
+    {
+        setProgramCounter( programCounter() + 1 );
+        retired++;
+        checkInterrupts();
+        if( interrupts_enabled ) // woken too early : IDLE runs again
+        {
+            setProgramCounter( programCounter() - 1 );
+            retired--;
+        }
+    }
+    else if( interrupts_armed ) // events which happened while suspended
+        checkInterrupts();
+    suspension = RUNNING;
+
+    bool running = execute( budget );
+    cooperative = false;
+
+    if( running )
+        return YIELDED;
+    if( suspension != RUNNING )
+        return SUSPENDED;
+    if( root == nullptr and not threadsFinished() ) // finish() would block joining them
+    {
+        suspension = WAITING_THREAD;
+        waiting_thread = nullptr;
+        return SUSPENDED;
+    }
+    finish();
+    return HALTED;
+}
+
+// a suspended program should not be resumed before this time
+std::chrono::steady_clock::time_point VM::wakeTime( void ) const
+{
+    if( suspension == SLEEPING or suspension == IDLING )
+        return wake_time;
+    return std::chrono::steady_clock::time_point::max();
+}
+
+// a suspended program waits for the console input
+bool VM::waitingInput( void ) const
+{
+    return suspension == WAITING_INPUT or ( suspension == IDLING and vectors[IRQ_INPUT] != NO_VECTOR );
+}
+
+// a program suspended by a channel or a thread can go on, checked without system calls
+bool VM::resumable( void ) const
+{
+    if( suspension == WAITING_CHANNEL )
+        return waiting_send ? waiting_channel->canSend() : waiting_channel->canReceive();
+    if( suspension == WAITING_THREAD )
+        return waiting_thread == nullptr ? threadsFinished() : waiting_thread->finished.load( std::memory_order_acquire );
+    return false;
+}
+
+// in virtual time, a program suspended by IDLE with a timer jumps to the timer deadline instead of
+// sleeping, unless its input is ready already. False if the program must wait to be resumed
+bool VM::skipIdle( void )
+{
+    using namespace std::chrono;
+    if( suspension != IDLING or not virtual_time or wake_time == steady_clock::time_point::max() )
+        return false;
+    if( vectors[IRQ_INPUT] == NO_VECTOR or not io->inputReady( 0 ))
+        skipped += std::max( steady_clock::duration::zero(), wake_time - now() );
+    return true;
+}
+
+// run() stops before the current instruction, executed again on the next call
+void VM::suspendInstruction( Suspension reason )
+{
+    setProgramCounter( programCounter() - 1 );
+    retired--;
+    suspension = reason;
+}
+
+// every thread spawned has halted, joining them would not block
+bool VM::threadsFinished( void ) const
+{
+    std::lock_guard<std::mutex> lock( threads_mutex );
+    return std::all_of( threads.begin(), threads.end(), []( const std::unique_ptr<GuestThread>& t )
+    {
+        return t->joined or t->finished.load( std::memory_order_acquire );
+    });
+}
+
+// end of the program : join the threads, present the last frame and write the output
+void VM::finish( void )
+{
+    if( root == nullptr ) // threads cannot outlive the program
+        joinThreads();
+    if( root == nullptr and present_period != std::chrono::steady_clock::duration::zero() )
+        presentFramebuffer(); // the last frame drawn
+    output->flush();
+    if( root == nullptr )
+        output->stopWriter();
 }
 
 // display the stack values
@@ -164,6 +349,533 @@ void VM::dispMemoryStackLight( void ) const
 }
 
 
+// bind a host function to a native slot, replacing any previous one ( built-ins included )
+void VM::registerNative( uint16_t slot, NativeFunction function )
+{
+    if( slot >= NATIVE_COUNT )
+        Error( "Native slot " + std::to_string( static_cast<unsigned>( slot ) ) + " is out of range" );
+    natives[slot] = std::move( function );
+}
+
+// choose the memory region managed by ALLOC and FREE, every live block is forgotten
+void VM::configureHeap( uint16_t base, uint32_t size )
+{
+    std::lock_guard<std::mutex> lock( heap_mutex );
+    heap.configure( base, size );
+    checkLayout();
+    updateStackLimits();
+}
+
+// allocation and fragmentation statistics of the guest heap
+const HeapStats& VM::heapStats( void ) const
+{
+    return heap.getStats();
+}
+
+// display the heap statistics
+void VM::dispHeapStats( void ) const
+{
+    const HeapStats& st = heap.getStats();
+    if( heap.getSize() == 0 )
+    {
+        cout << "Heap not used" << endl;
+        return;
+    }
+    cout << "Heap [" << heap.getBase() << ", " << heap.getBase() + heap.getSize() << "[ :\n"
+         << "  allocations  " << st.allocations << " ( " << st.failures << " failed ), frees " << st.frees << "\n"
+         << "  live words   " << st.live_words << " ( " << st.requested_words << " requested )\n"
+         << "  free lists   " << st.free_words << " words, carved " << st.carved_words << " / " << st.heap_words << "\n"
+         << "  fragmentation internal " << st.internalFragmentation() * 100 << " %, external "
+         << st.externalFragmentation() * 100 << " %" << endl;
+}
+
+// enable or disable the aggregation of MARK regions
+void VM::enableProfiling( bool enable )
+{
+    profiling = enable;
+    if( enable and regions.empty() )
+        regions.assign( 256, ProfileRegion() );
+}
+
+// amount of instructions executed since initialize()
+uint64_t VM::instructionsRetired( void ) const
+{
+    return retired;
+}
+
+// display count, instructions and wall time of every region used
+void VM::dispProfile( void ) const
+{
+    cout << "Profile ( " << retired << " instructions retired ) :" << endl;
+    for( size_t i = 0; i < regions.size(); i++ )
+    {
+        const ProfileRegion& r = regions[i];
+        if( r.count == 0 ) continue;
+
+        std::chrono::duration<double, std::milli> ms = r.time;
+        cout << "  region " << i << "\t" << r.count << " runs\t" << r.instructions << " instr\t"
+             << ms.count() << " ms\t" << r.instructions / r.count << " instr/run" << endl;
+    }
+}
+
+// wait for every thread started by SPAWN, called by start() when the program halts
+void VM::joinThreads( void )
+{
+    for( size_t i = 0; ; i++ )
+    {
+        GuestThread* t = nullptr;
+        {
+            std::lock_guard<std::mutex> lock( threads_mutex ); // threads may still spawn others
+            if( i >= threads.size() ) break;
+            t = threads[i].get();
+            if( t->joined ) continue;
+            t->joined = true;
+        }
+        t->thread.join();
+    }
+}
+
+// show width x height words of the memory from address as a grid of characters
+void VM::configureFramebuffer( uint16_t address, uint16_t width, uint16_t height, uint16_t rate )
+{
+    framebuffer = std::make_shared<Framebuffer>( address, width, height );
+    present_period = std::chrono::steady_clock::duration::zero();
+    if( rate != 0 )
+        present_period = std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::seconds( 1 )) / rate;
+    present_deadline = now() + present_period;
+    updateInterruptSources();
+}
+
+// draw the rows of the framebuffer changed since the last presentation
+void VM::presentFramebuffer( void )
+{
+    std::string drawing;
+    if( framebuffer->render( memory, output->isTerminal(), drawing ) > 0 )
+        output->writeNow( drawing );
+}
+
+// make a channel reachable by the guest under the given number, threads spawned afterward share it
+void VM::attachChannel( uint8_t number, std::shared_ptr<Channel> channel )
+{
+    if( number >= CHANNEL_COUNT )
+        Error( "Channel number " + std::to_string( static_cast<unsigned>( number )) + " is out of range" );
+    channels[number] = std::move( channel );
+}
+
+// wire the output channel of a VM to the input channel of another one, return the created channel
+std::shared_ptr<Channel> VM::connect( VM& producer, uint8_t out_number, VM& consumer, uint8_t in_number,
+                                      size_t capacity, Channel::Kind kind )
+{
+    std::shared_ptr<Channel> channel = Channel::create( capacity, kind );
+    producer.attachChannel( out_number, channel );
+    consumer.attachChannel( in_number, channel );
+    return channel;
+}
+
+// write the output from a thread of its own while the program runs
+void VM::setAsyncOutput( bool enable )
+{
+    async_output = enable;
+}
+
+// WAIT and IDLE return right away and advance a simulated clock instead of sleeping
+void VM::setVirtualTime( bool enable )
+{
+    virtual_time = enable;
+}
+
+// time skipped by WAIT and IDLE in virtual time since initialize()
+std::chrono::steady_clock::duration VM::skippedTime( void ) const
+{
+    return skipped;
+}
+
+// read INPUT from and write DISP to another console than the terminal, call before start()
+void VM::setIOBackend( std::shared_ptr<IOBackend> backend )
+{
+    output->flush(); // text displayed so far stays on the previous console
+    io = std::move( backend );
+    output = std::make_shared<OutputBuffer>( io );
+}
+
+// replace the flat memory by one using another host backend, call before load()
+void VM::setMemoryBackend( GuestMemory::Backend backend )
+{
+    memory_block = std::make_shared<GuestMemory>( backend );
+    memory = memory_block->data();
+}
+
+// replace the memory by a paged one backed by 'banks' banks of 4096 words, call before load()
+void VM::enablePagedMemory( uint32_t banks )
+{
+    memory_block = std::make_shared<GuestMemory>( banks );
+    memory = memory_block->data();
+}
+
+// host memory used by this VM, in bytes : guest memory pages committed, plus the VM itself,
+// its heap bookkeeping, profile regions and output buffer ( shared by threads, counted by the root )
+size_t VM::residentMemory( void ) const
+{
+    size_t bytes = memory_block->residentBytes() + sizeof( VM ) + heap.footprint() + regions.capacity() * sizeof( ProfileRegion );
+    if( root == nullptr )
+        bytes += output->footprint();
+    return bytes;
+}
+
+// map a physical bank onto one of the 16 windows of the address space ( paged memory only )
+void VM::mapBank( uint8_t window, uint32_t bank )
+{
+    memory_block->mapBank( window, bank );
+}
+
+// map a host file onto the memory from address ( a multiple of 2048 ), see GuestMemory::mapFile
+uint32_t VM::mapFile( const std::string& path, uint16_t address, bool writable )
+{
+    return memory_block->mapFile( path, address, writable );
+}
+
+// create a VM continuing from the current state, memory pages are shared copy-on-write
+std::unique_ptr<VM> VM::fork( void )
+{
+    if( root != nullptr )
+        Error( "Only a VM created by the host can be forked" );
+
+    auto child = std::make_unique<VM>();
+    child->memory_block = memory_block->fork();
+    child->memory  = child->memory_block->data();
+    child->program = program;
+    child->io      = io;
+    child->output  = output;
+    child->async_output = async_output;
+    child->framebuffer = framebuffer;
+    child->natives = natives;
+    child->channels = channels;
+    child->wide_calls = wide_calls;
+    child->reads_counter = reads_counter;
+    child->code_segment = code_segment;
+    child->rnd_seed = rnd_seed;
+    child->heap = heap;
+    child->stack_start = stack_start;
+    child->data_start = data_start;
+    child->data_end = data_end;
+    child->stack_limit.store( stack_limit.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+    child->retired = retired;
+    child->clock_origin = clock_origin;
+    child->virtual_time = virtual_time;
+    child->skipped = skipped;
+    child->profiling = profiling;
+    child->regions = regions;
+    child->vectors = vectors;
+    child->interrupts_enabled = interrupts_enabled;
+    child->timer_period = timer_period;
+    child->timer_deadline = timer_deadline;
+    child->interrupts_armed = interrupts_armed;
+    std::copy( reg, reg + R_COUNT, child->reg );
+    std::copy( flags, flags + F_COUNT, child->flags );
+    return child;
+}
+
+// seed the PRNG used by RAND, 0 is replaced by 1
+void VM::setSeed( uint16_t seed )
+{
+    rnd_seed = seed == 0 ? 1 : seed; // xorshift seed cannot be 0
+}
+
+// remember the current state as the one restored by reset()
+void VM::setResetPoint( void )
+{
+    memory_block->checkpoint();
+
+    reset_point = std::make_unique<ResetPoint>();
+    std::copy( reg, reg + R_COUNT, reset_point->reg );
+    std::copy( flags, flags + F_COUNT, reset_point->flags );
+    reset_point->rnd_seed = rnd_seed;
+    reset_point->code_segment = code_segment;
+    reset_point->retired = retired;
+    reset_point->heap = heap;
+    reset_point->vectors = vectors;
+    reset_point->interrupts_enabled = interrupts_enabled;
+    reset_point->timer_period = timer_period;
+}
+
+// restore the state of setResetPoint(), only the memory pages written since are rewritten
+uint32_t VM::reset( void )
+{
+    if( reset_point == nullptr )
+        Error( "Cannot reset a VM without reset point" );
+
+    std::copy( reset_point->reg, reset_point->reg + R_COUNT, reg );
+    std::copy( reset_point->flags, reset_point->flags + F_COUNT, flags );
+    rnd_seed = reset_point->rnd_seed;
+    code_segment = reset_point->code_segment;
+    retired = reset_point->retired;
+    vectors = reset_point->vectors;
+    interrupts_enabled = reset_point->interrupts_enabled;
+    timer_period = reset_point->timer_period;
+    timer_deadline = now() + timer_period;
+    updateInterruptSources();
+
+    // the heap bookkeeping is as large as the heap, only copy it back if ALLOC or FREE were used
+    const HeapStats& current = heap.getStats(), & then = reset_point->heap.getStats();
+    if( current.allocations != then.allocations or current.frees != then.frees or current.failures != then.failures )
+    {
+        heap = reset_point->heap;
+        updateStackLimit();
+    }
+
+    return memory_block->revert();
+}
+
+// fixed part of a snapshot file, followed by registers, flags, vectors, program and heap state,
+// then by the memory image from memory_offset ( a multiple of the host page size )
+struct SnapshotHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t register_count;
+    uint32_t flag_count;
+    uint32_t vector_count;
+    uint16_t rnd_seed;
+    uint16_t code_segment;
+    uint8_t  interrupts_enabled;
+    uint8_t  padding[7];
+    int64_t  timer_period;      // nanoseconds
+    uint64_t program_words;
+    uint64_t heap_words;
+    uint64_t memory_offset;
+};
+static const char     SNAPSHOT_MAGIC[8] = "BASALVM";
+static const uint32_t SNAPSHOT_VERSION  = 1;
+
+// write the state of a stopped VM to a file
+void VM::saveSnapshot( const std::string& path ) const
+{
+    if( memory_block->isPaged() )
+        Error( "Cannot snapshot a paged memory" );
+
+    std::vector<uint32_t> heap_state = heap.save();
+    uint8_t packed_flags[F_COUNT];
+    for( int f = 0; f < F_COUNT; f++ )
+        packed_flags[f] = flags[f];
+
+    SnapshotHeader header{};
+    std::memcpy( header.magic, SNAPSHOT_MAGIC, sizeof( header.magic ));
+    header.version            = SNAPSHOT_VERSION;
+    header.register_count     = R_COUNT;
+    header.flag_count         = F_COUNT;
+    header.vector_count       = VECTOR_COUNT;
+    header.rnd_seed           = rnd_seed;
+    header.code_segment       = code_segment;
+    header.interrupts_enabled = interrupts_enabled;
+    header.timer_period       = std::chrono::duration_cast<std::chrono::nanoseconds>( timer_period ).count();
+    header.program_words      = program->size();
+    header.heap_words         = heap_state.size();
+
+    // the memory image starts on a page, so that it can be mapped back
+    const size_t page_bytes = GuestMemory::pageWords() * sizeof( uint16_t );
+    size_t state_bytes = sizeof( header ) + sizeof( reg ) + sizeof( packed_flags ) + VECTOR_COUNT * sizeof( uint32_t )
+                       + ( program->size() + heap_state.size() ) * sizeof( uint32_t );
+    header.memory_offset = ( state_bytes + page_bytes - 1 ) / page_bytes * page_bytes;
+
+    std::vector<char> state( state_bytes );
+    char* cursor = state.data();
+    auto append = [&cursor]( const void* data, size_t bytes )
+    {
+        std::memcpy( cursor, data, bytes );
+        cursor += bytes;
+    };
+    append( &header, sizeof( header ));
+    append( reg, sizeof( reg ));
+    append( packed_flags, sizeof( packed_flags ));
+    append( vectors.data(), vectors.size() * sizeof( uint32_t ));
+    append( program->data(), program->size() * sizeof( uint32_t ));
+    append( heap_state.data(), heap_state.size() * sizeof( uint32_t ));
+
+    int fd = open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    bool written = fd >= 0
+               and write( fd, state.data(), state.size() ) == static_cast<ssize_t>( state.size() )
+               and memory_block->writeImage( fd, static_cast<off_t>( header.memory_offset ));
+    if( fd >= 0 )
+        close( fd );
+    if( not written )
+        Error( "Cannot write snapshot '" + path + "'" );
+}
+
+// restore a VM saved by saveSnapshot, in place of initialize() and load()
+void VM::loadSnapshot( const std::string& path )
+{
+    int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+    struct stat info;
+    if( fd < 0 or fstat( fd, &info ) != 0 )
+        Error( "Cannot open snapshot '" + path + "'" );
+
+    const size_t file_bytes = static_cast<size_t>( info.st_size );
+    void* mapped = file_bytes >= sizeof( SnapshotHeader ) ? mmap( nullptr, file_bytes, PROT_READ, MAP_PRIVATE, fd, 0 ) : MAP_FAILED;
+    if( mapped == MAP_FAILED )
+        Error( "Cannot read snapshot '" + path + "'" );
+    const char* file = static_cast<const char*>( mapped );
+
+    SnapshotHeader header;
+    std::memcpy( &header, file, sizeof( header ));
+    size_t state_bytes = sizeof( header ) + sizeof( reg ) + F_COUNT + VECTOR_COUNT * sizeof( uint32_t )
+                       + ( header.program_words + header.heap_words ) * sizeof( uint32_t );
+    if( std::memcmp( header.magic, SNAPSHOT_MAGIC, sizeof( header.magic )) != 0 or header.version != SNAPSHOT_VERSION )
+        Error( "'" + path + "' is not a snapshot of this version of the VM" );
+    if( header.register_count != R_COUNT or header.flag_count != F_COUNT or header.vector_count != VECTOR_COUNT
+        or header.program_words == 0 or header.program_words > file_bytes or header.heap_words > file_bytes
+        or state_bytes > header.memory_offset or header.memory_offset % ( GuestMemory::pageWords() * sizeof( uint16_t )) != 0
+        or header.memory_offset + GuestMemory::SIZE * sizeof( uint16_t ) != file_bytes )
+        Error( "Snapshot '" + path + "' is corrupted" );
+
+    initialize();
+
+    const char* cursor = file + sizeof( header );
+    auto read = [&cursor]( void* data, size_t bytes )
+    {
+        std::memcpy( data, cursor, bytes );
+        cursor += bytes;
+    };
+    uint8_t packed_flags[F_COUNT];
+    std::vector<uint32_t> code( header.program_words );
+    std::vector<uint32_t> heap_state( header.heap_words );
+    read( reg, sizeof( reg ));
+    read( packed_flags, sizeof( packed_flags ));
+    read( vectors.data(), vectors.size() * sizeof( uint32_t ));
+    read( code.data(), code.size() * sizeof( uint32_t ));
+    read( heap_state.data(), heap_state.size() * sizeof( uint32_t ));
+    munmap( mapped, file_bytes );
+
+    for( int f = 0; f < F_COUNT; f++ )
+        flags[f] = packed_flags[f] != 0;
+    if( not heap.restore( heap_state ))
+        Error( "Snapshot '" + path + "' is corrupted" );
+    updateStackLimit();
+    program = std::make_shared<const std::vector<uint32_t>>( std::move( code ));
+    wide_calls = program->size() > 65536;
+    reads_counter = containsCycles( *program );
+    code_segment = header.code_segment;
+    setSeed( header.rnd_seed );
+    interrupts_enabled = header.interrupts_enabled != 0;
+    timer_period = std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::nanoseconds( header.timer_period ));
+    timer_deadline = now() + timer_period;
+    updateInterruptSources();
+
+    memory_block = GuestMemory::fromImage( fd, static_cast<off_t>( header.memory_offset ));
+    memory = memory_block->data();
+    close( fd ); // the mapping keeps the file alive
+}
+
+// VM owning the resources shared between threads
+VM& VM::rootVM( void )
+{
+    return root == nullptr ? *this : *root;
+}
+
+// compute stack_limit from stack_start and the heap of the root VM
+void VM::updateStackLimit( void )
+{
+    const VM& owner = rootVM();
+    uint32_t limit = UINT16_MAX - 1;
+    if( owner.heap.getSize() > 0 and stack_start < owner.heap.getBase() )
+        limit = owner.heap.getBase() - 1u;
+    if( owner.data_end > owner.data_start and stack_start < owner.data_start )
+        limit = std::min( limit, owner.data_start - 1u );
+    stack_limit.store( static_cast<uint16_t>( limit ), std::memory_order_relaxed );
+}
+
+// stop the VM if the heap overlaps the initialized data or the start of the stack ( root only )
+void VM::checkLayout( void ) const
+{
+    if( data_end == data_start )
+        return;
+    uint32_t first_push = stack_start + 1u; // push increments sp before writing
+    if( first_push >= data_start and first_push < data_end )
+        Error( "Initialized data overlaps the stack, move it with .data" );
+    uint32_t heap_end = heap.getBase() + heap.getSize();
+    if( heap.getSize() > 0 and data_start < heap_end and heap.getBase() < data_end )
+        Error( "Initialized data overlaps the heap, move it with .data or --heap" );
+}
+
+// update stack_limit in the root VM and every context sharing its memory, heap_mutex held ( root only )
+void VM::updateStackLimits( void )
+{
+    updateStackLimit();
+    std::lock_guard<std::mutex> lock( threads_mutex );
+    for( const std::unique_ptr<GuestThread>& t : threads )
+        t->context->updateStackLimit();
+}
+
+// create a context sharing memory, program and natives, starting with a copy of registers and flags
+std::unique_ptr<VM> VM::createContext( void )
+{
+    auto context = std::make_unique<VM>();
+    shareWith( *context );
+    context->vectors.fill( NO_VECTOR ); // interrupts are private to each context
+    context->rnd_seed = xorshift16() | 1; // each context has its own random sequence, xorshift seed cannot be 0
+    std::copy( reg, reg + R_COUNT, context->reg );
+    std::copy( flags, flags + F_COUNT, context->flags );
+    return context;
+}
+
+// give a context the memory, program, console, natives... this VM uses now
+void VM::shareWith( VM& context )
+{
+    context.memory_block = memory_block;
+    context.memory  = memory;
+    context.program = program;
+    context.io      = io;
+    context.output  = output;
+    context.framebuffer = framebuffer;
+    context.natives = natives;
+    context.channels = channels;
+    context.wide_calls = wide_calls;
+    context.reads_counter = reads_counter;
+    context.code_segment = code_segment;
+    context.root    = &rootVM();
+    context.clock_origin = clock_origin;
+    context.virtual_time = virtual_time;
+    context.skipped = skipped;
+}
+
+// push the address of the HALT closing the program, so that a 'ret' from the current routine stops the VM
+void VM::pushReturnToHalt( void )
+{
+    uint32_t halt_address = static_cast<uint32_t>( program->size() - 1 ); // the assembler always ends with HALT
+    pushReturnAddress( halt_address );
+}
+
+// 32 bits address of the next instruction
+uint32_t VM::programCounter( void ) const
+{
+    return ( static_cast<uint32_t>( code_segment ) << 16 ) | reg[ip];
+}
+
+// continue the execution at a 32 bits address
+void VM::setProgramCounter( uint32_t address )
+{
+    reg[ip] = static_cast<uint16_t>( address );
+    code_segment = static_cast<uint16_t>( address >> 16 );
+}
+
+// push a return address : one word, or two for programs larger than 65536 instructions
+void VM::pushReturnAddress( uint32_t address )
+{
+    if( wide_calls )
+        executePUSH( 0x91000000 | ( address >> 16 ));
+    executePUSH( 0x91000000 | ( address & 0x0000FFFF ));
+}
+
+// pop a return address pushed by pushReturnAddress and continue the execution there
+void VM::popReturnAddress( void )
+{
+    executePOP( 0xA0900000 ); // pop ip
+    if( wide_calls )
+    {
+        code_segment = memory[reg[sp]];
+        executePOP( 0xA1000000 );
+    }
+}
+
 // check if the address is RESERVED
 void VM::checkForSegfault( const uint16_t& address ) const
 {
@@ -328,20 +1040,30 @@ void VM::executePUSH( const uint32_t& instruction )
     uint16_t mode   = ( instruction & 0x0F000000 ) >> 24;   // mode of the instruction
     uint16_t src    = ( instruction & 0x0000F000 ) >> 12;   // source register
 
-    if( reg[sp] < UINT16_MAX-1 ) // check for room in VM memory
+    if( reg[sp] >= stack_limit.load( std::memory_order_relaxed )) // check for room in VM memory
+        stackOverflow();
+
+    if( mode == 0 ) // push source register
     {
-        if( mode == 0 ) // push source register
-        {
-            memory[++reg[sp]] = reg[src];
-        }
-        else if( mode == 1 ) // push immediate value
-        {
-            int16_t value = ( instruction & 0x0000FFFF );
-            memory[++reg[sp]] = static_cast<uint16_t>( value );
-        }
+        memory[++reg[sp]] = reg[src];
+    }
+    else if( mode == 1 ) // push immediate value
+    {
+        int16_t value = ( instruction & 0x0000FFFF );
+        memory[++reg[sp]] = static_cast<uint16_t>( value );
     }
-    else // not enough memory left to push
-        Error("Out of memory");
+}
+
+// stop the VM, PUSH or CALL reached stack_limit
+void VM::stackOverflow( void ) const
+{
+    const VM& owner = root == nullptr ? *this : *root;
+    uint32_t end = stack_limit.load( std::memory_order_relaxed ) + 1u;
+    if( owner.heap.getSize() > 0 and end == owner.heap.getBase() )
+        Error("Stack overflow into the heap");
+    if( owner.data_end > owner.data_start and end == owner.data_start )
+        Error("Stack overflow into the initialized data");
+    Error("Out of memory"); // not enough memory left to push
 }
 
 // take the top value, and decrement rsp, while placing ( or discarding ) the value in a register
@@ -413,39 +1135,32 @@ void VM::executePROMPT( const uint32_t& instruction )
         {
             case 0: // char
                 if( src_value == 219 ) // Extended ASCII, allow to draw "█" 
-                    cout << "█";
+                    output->write( "█" );
                 else
-                    cout << static_cast<char>( src_value ); 
+                {
+                    char c = static_cast<char>( src_value );
+                    output->write( std::string_view( &c, 1 ));
+                }
                 break;
             case 1: // int
-                cout << static_cast<int16_t>( src_value );
+                output->writeNumber( static_cast<int16_t>( src_value ));
                 break;
             case 2: // mem
-                cout << src_value;
+                output->writeNumber( src_value );
                 break;
             case 3: // hex
-                cout << std::hex << std::uppercase << src_value << std::dec;
+                output->writeNumber( src_value, 16 );
                 break; 
             case 4: // bin
-            {
-                std::bitset<16> binNbr( src_value );
-                cout << binNbr ;
+                output->writeBinary( src_value );
                 break;
-            }
             case 5: // str
             {
                 if( l_mode != 1 and l_mode != 3 )
                     Error("Runtime error which should be compile-time error: Cannot only display string on addresses");
                 
-                string mess = "";
-                uint16_t cursor = address; // initialize at start of string
-                while( memory[ cursor ] != 0 )
-                {
-                    mess += static_cast<char>( memory[cursor] );
-                    if( cursor < UINT16_MAX ) // avoid overflow
-                        cursor += 1;
-                }
-                cout << mess ;
+                // read in place up to the 0 closing the string, or to the end of the memory
+                output->writeWords( memory + address, GuestMemory::SIZE - address );
                 break;
             }
             default:
@@ -454,6 +1169,12 @@ void VM::executePROMPT( const uint32_t& instruction )
     }
     else if( select == 2 ) // input
     {
+        output->flush(); // the prompt must be visible
+        if( cooperative and not io->inputReady( 0 )) // run() returns, INPUT runs again once the input is ready
+        {
+            suspendInstruction( WAITING_INPUT );
+            return;
+        }
         switch( l_mode )
         {
             case 0: // value
@@ -483,69 +1204,33 @@ void VM::executePROMPT( const uint32_t& instruction )
         switch( r_mode )
         {
             case 0: // char
-            {
-                char input_value;
-                cin >> input_value;
-                *src_p = static_cast<uint16_t>( input_value );
+                *src_p = static_cast<uint16_t>( io->readChar() );
                 break;
-            }
             case 1: // int
-            {
-                int16_t input_value;
-                cin >> input_value;
-                *src_p = static_cast<uint16_t>( input_value );
-                break;
-            }
             case 2: // mem
-            {
-                uint16_t input_value;
-                cin >> input_value;
-                *src_p = input_value;
-                break;
-            }
             case 3: // hex
-            {
-                uint16_t input_value;
-                string input_string;
-                cin >> input_string;
-                if( lexer::matchHexaValue( input_string.c_str() ))
-                    input_value = parseInputValue( input_string );
-                else
-                    input_value = 0;
-                *src_p = input_value ;
-                break; 
-            }
             case 4: // bin
             {
-                uint16_t input_value;
-                string input_string;
-                cin >> input_string;
-                if( lexer::matchBinValue( input_string.c_str() ))
-                    input_value = parseInputValue( input_string );
-                else
-                    input_value = 0;
-                *src_p = input_value;
-                break; 
+                static const int bases[] = { 10, 10, 16, 2 };
+                if( not io->readNumber( bases[r_mode - 1], *src_p ))
+                    Error( "Input value is too big to be encoded" );
+                break;
             }
             case 5: // str
             {
-                string input_string;
-                std::getline(cin, input_string);
-                if( address + input_string.length() >= UINT16_MAX )
+                // copied straight from the input to the memory, the 0 closing the string included
+                size_t capacity = GuestMemory::SIZE - 1 - address;
+                size_t length = io->readLine( memory + address, capacity );
+                if( length > capacity )
                     Error("Not enough memory to store input string");
-                else
-                {
-                    for( unsigned i=0; i<input_string.length(); i++)
-                    {
-                        memory[address + i] = static_cast<uint16_t>( input_string[i] );
-                    }
-                    memory[address + input_string.length()] = static_cast<uint16_t>( 0 );
-                }
+                memory[address + length] = 0;
                 break;
             }
             default:
                 Error("Unexpected value in instruction");
         }
+        if( output->isTerminal() ) // the terminal echoed the input under the frame drawn
+            output->invalidate();
     }
 }
 
@@ -618,18 +1303,30 @@ void VM::executeWAIT( const uint32_t& instruction )
     // uncomment below to display precisely the time slept.
     using namespace std::chrono_literals;
     // auto start = std::chrono::high_resolution_clock::now();
-    if( mode == 0 )
-        std::this_thread::sleep_for(std::chrono::seconds( value ));
-    if( mode == 1 )
-        std::this_thread::sleep_for(std::chrono::milliseconds( value ));
-    if( mode == 2 )
-        std::this_thread::sleep_for(std::chrono::microseconds( value ));
+    std::chrono::steady_clock::duration duration{ 0 };
+    if( mode == 0 )      duration = std::chrono::seconds( value );
+    else if( mode == 1 ) duration = std::chrono::milliseconds( value );
+    else if( mode == 2 ) duration = std::chrono::microseconds( value );
+
+    output->flush(); // show what was displayed before waiting
+    if( virtual_time )
+        skipped += duration;
+    else if( cooperative ) // run() returns, the program is resumed later
+    {
+        wake_time = now() + duration;
+        suspension = SLEEPING;
+        return;
+    }
+    else
+        std::this_thread::sleep_for( duration );
+    presentIfDue(); // time passed without instructions
     // auto end = std::chrono::high_resolution_clock::now();
     // std::chrono::duration<double, std::milli> elapsed = end-start;
     // cout << "Waited " << elapsed.count() << " ms\n";
 }
 
 // contains jump, conditionnal jump, call and ret
+// the target is in the current 64K segment of the program, see executeFAR for the others
 void VM::executeJUMP( const uint32_t& instruction )
 {
     uint16_t mode   = ( instruction & 0x0F000000 ) >> 24;   // select operator( unconditionnal jump, call, ret or conditionnal jump )
@@ -643,12 +1340,12 @@ void VM::executeJUMP( const uint32_t& instruction )
     }
     else if( mode == 1 ) // unconditionnal call
     {
-        executePUSH( 0x90009000 );
+        pushReturnAddress( programCounter() );
         reg[ip] = value;
     }
     else if( mode == 2 ) // ret
     {
-        executePOP( 0xA0900000 );
+        popReturnAddress();
     }
     else if( mode == 3 ) // conditionnal jump
     {
@@ -661,7 +1358,7 @@ void VM::executeJUMP( const uint32_t& instruction )
     {
         if( sign == flags[ cpuFlag ])
         {
-            executePUSH( 0x90009000 );
+            pushReturnAddress( programCounter() );
             reg[ip] = value;
         }
     }
@@ -669,7 +1366,7 @@ void VM::executeJUMP( const uint32_t& instruction )
     {
         if( sign == flags[ cpuFlag ])
         {
-            executePOP( 0xA0900000 );
+            popReturnAddress();
         }
     }
 }
@@ -677,12 +1374,13 @@ void VM::executeJUMP( const uint32_t& instruction )
 
 
 // redirect to the correct function depending on the instruction code contained in the first 8 bits
-bool VM::processInstruction( const uint32_t& instruction )
+inline bool VM::processInstruction( const uint32_t& instruction )
 {
     // get the current opcode
     OP op = getInstruction( instruction );
     
-    reg[ip]++; // increment ip
+    if( ++reg[ip] == 0 ) // increment ip, carry into the segment for programs larger than 65536 instructions
+        code_segment++;
 
     switch( op )
     {
@@ -700,19 +1398,19 @@ bool VM::processInstruction( const uint32_t& instruction )
             break;
         case WAIT:
             executeWAIT( instruction ); 
-            break;
+            return suspension == RUNNING;
         case JUMP:
             executeJUMP( instruction );
             break;
         case PROMPT:
             executePROMPT( instruction ); 
-            break;
+            return suspension == RUNNING;
         case HALT:
             return false; 
             break;
         case MISC:
             selectMISC( instruction );
-            break;
+            return suspension == RUNNING and not redispatch;
         default :
             executeAddBasedOP( instruction, op ); 
             break;
@@ -721,6 +1419,47 @@ bool VM::processInstruction( const uint32_t& instruction )
 }
 
 
+// execute at most 'budget' instructions with the dispatch loop the program needs
+bool VM::execute( uint64_t budget )
+{
+    for( ;; )
+    {
+        redispatch = false;
+        bool running = ( profiling or reads_counter or interrupts_armed ) ? dispatch<true>( budget ) : dispatch<false>( budget );
+        if( running or not redispatch or suspension != RUNNING )
+            return running;
+        // interrupts were armed or disarmed : go on with the other loop
+    }
+}
+
+// one dispatch loop, 'budget' is decreased by the amount executed
+template<bool EXACT>
+bool VM::dispatch( uint64_t& budget )
+{
+    const uint32_t* code = program->data();
+    uint64_t executed = 0;
+    bool running = true;
+    while( running and executed < budget )
+    {
+        executed++;
+        if constexpr( EXACT )
+            retired++;
+        running = processInstruction( code[( static_cast<uint32_t>( code_segment ) << 16 ) | reg[ip]] );
+        // dispMemoryStackLight();
+        // cout << std::hex << std::uppercase <<  code[programCounter()] << std::dec << endl; 
+        if constexpr( EXACT )
+        {
+            if( running and interrupts_armed and ( retired & ( INTERRUPT_PERIOD - 1 )) == 0 )
+                checkInterrupts();
+        }
+    }
+    if constexpr( not EXACT )
+        retired += executed;
+    budget -= executed;
+    return running;
+}
+
+
 //  +------------------------------+
 //  |    Flags Update Functions    |
 //  +------------------------------+
@@ -822,8 +1561,40 @@ void VM::selectMISC( const uint32_t& instruction )
     switch( selector )
     {
         case 1:
-            cout << std::flush;
-            ClearConsole();
+            output->clearScreen();
+            break;
+        case 2:
+            executeNATIVE( instruction );
+            break;
+        case 3:
+            executeHEAP( instruction );
+            break;
+        case 4:
+            executePROFILE( instruction );
+            break;
+        case 5:
+            executeTHREAD( instruction );
+            break;
+        case 6:
+            executeATOMIC( instruction );
+            break;
+        case 7:
+            executeCHANNEL( instruction );
+            break;
+        case 8:
+            executePFOR( instruction );
+            break;
+        case 9:
+            executeINTERRUPT( instruction );
+            break;
+        case 10:
+            executeBANK( instruction );
+            break;
+        case 11:
+            executeFAR( instruction );
+            break;
+        case 12:
+            executePRESENT( instruction );
             break;
         default:
             Error("Instruction Error");
@@ -831,5 +1602,527 @@ void VM::selectMISC( const uint32_t& instruction )
     }
 }
 
+// call the host function bound to the slot contained in the last 16 bits
+void VM::executeNATIVE( const uint32_t& instruction )
+{
+    uint16_t slot = ( instruction & 0x0000FFFF );
+
+    if( slot >= NATIVE_COUNT or natives[slot] == nullptr )
+        Error( "No native function bound to slot " + std::to_string( static_cast<unsigned>( slot ) ) );
+
+    NativeContext ctx{ reg, std::span<uint16_t>( memory, GuestMemory::SIZE ), flags };
+    natives[slot]( ctx );
+}
+
+// ALLOC a block from the heap and put its address in a register, or FREE it
+void VM::executeHEAP( const uint32_t& instruction )
+{
+    uint16_t mode  = ( instruction & 0x00F00000 ) >> 20;   // 0: alloc immediate | 1: alloc register | 2: free
+    uint16_t dest  = ( instruction & 0x000F0000 ) >> 16;   // register receiving ( or holding ) the address
+    uint16_t src   = ( instruction & 0x000000F0 ) >>  4;   // register holding the size
+    uint16_t value = ( instruction & 0x0000FFFF );         // immediate size
 
+    VM& owner = rootVM(); // the heap is shared by every thread
+    Heap& shared_heap = owner.heap;
+    std::lock_guard<std::mutex> lock( owner.heap_mutex );
 
+    if( mode != 2 and shared_heap.getSize() == 0 ) // the first ALLOC of a program sets up the default heap
+    {
+        shared_heap.configure( DEFAULT_HEAP_BASE, DEFAULT_HEAP_SIZE );
+        owner.checkLayout();
+        owner.updateStackLimits();
+        if( reg[sp] > stack_limit.load( std::memory_order_relaxed ))
+            Error("Stack overflow into the heap");
+    }
+
+    switch( mode )
+    {
+        case 0: // alloc immediate size
+            reg[dest] = shared_heap.allocate( value );
+            updateFlags( reg[dest] );   // ZRO is set when the allocation failed
+            break;
+        case 1: // alloc size from register
+            reg[dest] = shared_heap.allocate( reg[src] );
+            updateFlags( reg[dest] );
+            break;
+        case 2: // free
+            if( not shared_heap.release( reg[dest] ))
+                Error( "Invalid free of address " + std::to_string( static_cast<unsigned>( reg[dest] )) );
+            break;
+        default:
+            Error("Unexpected value in instruction");
+    }
+}
+
+// CYCLES and CLOCK read 32 bits counters into two registers, MARK delimits profiled regions
+void VM::executePROFILE( const uint32_t& instruction )
+{
+    uint16_t mode   = ( instruction & 0x00F00000 ) >> 20;   // 0: cycles | 1: clock | 2: mark begin | 3: mark end
+    uint16_t high   = ( instruction & 0x000F0000 ) >> 16;   // register receiving the high word
+    uint16_t low    = ( instruction & 0x0000F000 ) >> 12;   // register receiving the low word
+    uint16_t region = ( instruction & 0x000000FF );         // region number used by mark
+
+    if( mode >= 2 and not profiling ) // markers cost nothing more than this test when profiling is off
+        return;
+
+    switch( mode )
+    {
+        case 0: // cycles, instructions retired ( this one included )
+        {
+            uint32_t count = static_cast<uint32_t>( retired );
+            reg[high] = static_cast<uint16_t>( count >> 16 );
+            reg[low]  = static_cast<uint16_t>( count );
+            break;
+        }
+        case 1: // clock, monotonic microseconds since initialize()
+        {
+            auto elapsed = now() - clock_origin;
+            uint32_t us = static_cast<uint32_t>( std::chrono::duration_cast<std::chrono::microseconds>( elapsed ).count() );
+            reg[high] = static_cast<uint16_t>( us >> 16 );
+            reg[low]  = static_cast<uint16_t>( us );
+            break;
+        }
+        case 2: // mark begin
+        {
+            ProfileRegion& r = regions[region];
+            r.open = true;
+            r.start_retired = retired;
+            r.start_time = std::chrono::steady_clock::now();
+            break;
+        }
+        case 3: // mark end, ignored if the region was not opened
+        {
+            ProfileRegion& r = regions[region];
+            if( not r.open ) break;
+            r.open = false;
+            r.count++;
+            r.instructions += retired - r.start_retired;
+            r.time += std::chrono::steady_clock::now() - r.start_time;
+            break;
+        }
+        default:
+            Error("Unexpected value in instruction");
+    }
+}
+
+// SPAWN a thread at a label, JOIN it, or issue a memory FENCE
+void VM::executeTHREAD( const uint32_t& instruction )
+{
+    uint16_t mode  = ( instruction & 0x00F00000 ) >> 20;   // 0: spawn | 1: join | 2: fence
+    uint16_t r     = ( instruction & 0x000F0000 ) >> 16;   // spawn: stack address, then thread id | join: thread id
+    uint16_t label = ( instruction & 0x0000FFFF );         // entry point of the new thread
+
+    VM& owner = rootVM();
+
+    switch( mode )
+    {
+        case 0: // spawn
+        {
+            // an ALLOC configuring the heap updates the limit of every thread listed
+            std::scoped_lock lock( owner.heap_mutex, owner.threads_mutex );
+            std::unique_ptr<VM> context = createContext();
+            context->reg[sp] = reg[r];
+            context->stack_start = reg[r];
+            context->updateStackLimit();
+            context->setProgramCounter( label );
+            context->pushReturnToHalt(); // the thread ends when its entry routine returns
+
+            auto t = std::make_unique<GuestThread>();
+            t->context = std::move( context );
+            t->thread  = std::thread( []( GuestThread* spawned ) // spawn happens before the first instruction of the thread
+            {
+                spawned->context->start();
+                spawned->finished.store( true, std::memory_order_release );
+            }, t.get() );
+            owner.threads.push_back( std::move( t ));
+            reg[r] = static_cast<uint16_t>( owner.threads.size() ); // thread id
+            updateFlags( reg[r] );
+            break;
+        }
+        case 1: // join, the last instruction of the thread happens before join returns
+        {
+            GuestThread* t = nullptr;
+            {
+                std::lock_guard<std::mutex> lock( owner.threads_mutex );
+                if( reg[r] == 0 or reg[r] > owner.threads.size() or owner.threads[reg[r] - 1]->joined )
+                    Error( "Cannot join thread " + std::to_string( static_cast<unsigned>( reg[r] )) );
+                t = owner.threads[reg[r] - 1].get();
+                if( cooperative and not t->finished.load( std::memory_order_acquire )) // run() returns, JOIN runs again
+                {
+                    waiting_thread = t;
+                    suspendInstruction( WAITING_THREAD );
+                    break;
+                }
+                t->joined = true;
+            }
+            t->thread.join();
+            break;
+        }
+        case 2: // fence
+            std::atomic_thread_fence( std::memory_order_seq_cst );
+            break;
+        default:
+            Error("Unexpected value in instruction");
+    }
+}
+
+// atomic XADD, XCHG and CAS on a dereferenced register
+void VM::executeATOMIC( const uint32_t& instruction )
+{
+    uint16_t mode     = ( instruction & 0x00F00000 ) >> 20;   // 0: xadd | 1: xchg | 2: cas
+    uint16_t value    = ( instruction & 0x000F0000 ) >> 16;   // operand, receive the previous memory value
+    uint16_t desired  = ( instruction & 0x0000F000 ) >> 12;   // cas : value stored when memory equals the operand
+    uint16_t addr_reg = ( instruction & 0x000000F0 ) >>  4;   // register holding the address
+    bool     off_sign = ( instruction & 0x00000008 ) >>  0;   // address offset sign
+    uint16_t offset   = ( instruction & 0x00000007 ) >>  0;   // address offset
+
+    uint16_t address = static_cast<uint16_t>( reg[addr_reg] + coef( off_sign ) * offset );
+    checkForSegfault( address );
+    std::atomic_ref<uint16_t> word( memory[address] );
+
+    switch( mode )
+    {
+        case 0: // xadd
+            reg[value] = word.fetch_add( reg[value] );
+            updateFlags( reg[value] );
+            break;
+        case 1: // xchg
+            reg[value] = word.exchange( reg[value] );
+            updateFlags( reg[value] );
+            break;
+        case 2: // cas, EQU tells if the exchange happened, otherwise the operand receives the current value
+        {
+            bool swapped = word.compare_exchange_strong( reg[value], reg[desired] );
+            updateFlags( reg[value] );
+            flags[EQU] = swapped;
+            break;
+        }
+        default:
+            Error("Unexpected value in instruction");
+    }
+}
+
+// SEND and RECV words or memory blocks on a channel, blocking or not
+// EQU is set when the operation succeeded : a blocking operation only fails on a closed channel
+void VM::executeCHANNEL( const uint32_t& instruction )
+{
+    uint16_t mode   = ( instruction & 0x00F00000 ) >> 20;   // 0: send | 1: recv | 2: trysend | 3: tryrecv | 4: sendm | 5: recvm
+    uint16_t number = ( instruction & 0x000F0000 ) >> 16;   // channel number
+    uint16_t r      = ( instruction & 0x0000F000 ) >> 12;   // value register, or address register for blocks
+    uint16_t count  = ( instruction & 0x00000F00 ) >>  8;   // register holding the block size
+
+    Channel* channel = channels[number].get();
+    if( channel == nullptr )
+        Error( "No channel attached to number " + std::to_string( static_cast<unsigned>( number )) );
+
+    // one word through the channel : blocks, except under run() where 'wait' is set instead
+    bool wait = false;
+    auto transfer = [&]( bool sending, uint16_t& word )
+    {
+        if( not cooperative )
+            return sending ? channel->send( word ) : channel->receive( word );
+        if( sending ? channel->trySend( word ) : channel->tryReceive( word ))
+            return true;
+        if( channel->isClosed() ) // fails like the blocking calls, values sent before closing are still received
+            return not sending and channel->tryReceive( word );
+        wait = true;
+        waiting_send = sending;
+        return false;
+    };
+
+    bool ok = false;
+    switch( mode )
+    {
+        case 0: // send
+            ok = transfer( true, reg[r] );
+            break;
+        case 1: // recv
+            ok = transfer( false, reg[r] );
+            if( not wait )
+                updateFlags( reg[r] );
+            break;
+        case 2: // trysend
+            ok = channel->trySend( reg[r] );
+            break;
+        case 3: // tryrecv
+            ok = channel->tryReceive( reg[r] );
+            updateFlags( reg[r] );
+            break;
+        case 4: // sendm, send reg[count] words starting at address reg[r]
+        case 5: // recvm, receive reg[count] words and store them starting at address reg[r]
+        {
+            uint32_t address = reg[r];
+            if( address + reg[count] > UINT16_MAX )
+                Error( "Channel block out of memory bounds" );
+            checkForSegfault( reg[r] );
+
+            ok = true;
+            uint32_t i = channel_done; // resumed after a suspension : the words moved already stay moved
+            for( ; i < reg[count] and ok; i++ )
+                ok = transfer( mode == 4, memory[address + i] );
+            if( wait )
+                channel_done = i - 1;
+            break;
+        }
+        default:
+            Error("Unexpected value in instruction");
+    }
+
+    if( wait ) // run() returns, the instruction runs again once the channel has room or a value
+    {
+        waiting_channel = channel;
+        suspendInstruction( WAITING_CHANNEL );
+        return;
+    }
+    channel_done = 0;
+    flags[EQU] = ok;
+}
+
+// PFOR : call a routine for every index of a range, split across the host thread pool
+// each worker has its own registers, flags and stack, the caller resumes once every index is done
+void VM::executePFOR( const uint32_t& instruction )
+{
+    uint16_t index = ( instruction & 0x00F00000 ) >> 20;   // register receiving the index, holds the first index
+    uint16_t end   = ( instruction & 0x000F0000 ) >> 16;   // register holding the end of the range ( excluded )
+    uint16_t label = ( instruction & 0x0000FFFF );         // routine called for every index
+
+    uint16_t first = reg[index];
+    uint16_t last  = reg[end];
+    if( last <= first )
+        return;
+    if( cooperative ) // the workers would hold the thread of the scheduler, and block on VMs it runs
+        Error( "PFOR cannot run under VM::run, it blocks the host thread" );
+
+    ThreadPool& pool = ThreadPool::shared();
+    unsigned workers = pool.size();
+
+    // every worker stack lives above the stack of the caller, below the heap if the caller stack is
+    uint32_t stack_base = reg[sp] + 1u;
+    if( stack_base + workers * PFOR_STACK_SIZE > stack_limit.load( std::memory_order_relaxed ) + 1u )
+        Error( "Out of memory for the stacks of the PFOR workers" );
+
+    // the contexts are created by the first PFOR only, the next ones refresh what they share
+    while( pfor_contexts.size() < workers )
+        pfor_contexts.push_back( createContext() );
+    for( const std::unique_ptr<VM>& context : pfor_contexts )
+    {
+        shareWith( *context );
+        context->retired = 0;
+    }
+    std::vector<std::unique_ptr<VM>>& contexts = pfor_contexts;
+
+    // a few chunks per worker to balance uneven routines, without paying the dispatch for every index
+    size_t count  = last - first;
+    size_t chunks = std::min<size_t>( count, workers * 4 );
+    size_t chunk_size = ( count + chunks - 1 ) / chunks;
+
+    pool.run( chunks, [&]( size_t chunk, unsigned worker )
+    {
+        VM& context = *contexts[worker];
+        size_t begin = first + chunk * chunk_size;
+        size_t stop  = std::min<size_t>( begin + chunk_size, last );
+        for( size_t i = begin; i < stop; i++ )
+        {
+            std::copy( reg, reg + R_COUNT, context.reg );
+            std::copy( flags, flags + F_COUNT, context.flags );
+            context.reg[index] = static_cast<uint16_t>( i );
+            context.reg[sp] = static_cast<uint16_t>( stack_base + worker * PFOR_STACK_SIZE );
+            context.stack_start = context.reg[sp];
+            context.stack_limit.store( static_cast<uint16_t>( context.stack_start + PFOR_STACK_SIZE - 1 ), std::memory_order_relaxed );
+            context.pushReturnToHalt();     // the routine 'ret' ends the worker
+            context.setProgramCounter( label );
+            context.start();
+        }
+    });
+
+    for( const std::unique_ptr<VM>& context : contexts )
+        retired += context->retired;
+}
+
+// IVEC, TIMER, IRET, IDLE, STI and CLI
+void VM::executeINTERRUPT( const uint32_t& instruction )
+{
+    uint16_t mode   = ( instruction & 0x00F00000 ) >> 20;   // 0: ivec | 1: timer | 2: iret | 3: idle | 4: sti | 5: cli
+    uint16_t param  = ( instruction & 0x000F0000 ) >> 16;   // ivec: vector | timer: unit ( 0: s | 1: ms | 2: us )
+    uint16_t value  = ( instruction & 0x0000FFFF );         // ivec: handler address | timer: period
+
+    switch( mode )
+    {
+        case 0: // ivec
+            vectors[param] = value;
+            updateInterruptSources();
+            break;
+        case 1: // timer, a period of 0 disarms it
+        {
+            using namespace std::chrono;
+            if( param == 0 )      timer_period = seconds( value );
+            else if( param == 1 ) timer_period = milliseconds( value );
+            else                  timer_period = microseconds( value );
+            timer_deadline = now() + timer_period;
+            updateInterruptSources();
+            break;
+        }
+        case 2: // iret
+        {
+            popReturnAddress();
+            uint16_t packed = memory[reg[sp]];
+            executePOP( 0xA1000000 );   // discard flags word
+            for( int i = 0; i < F_COUNT; i++ )
+                flags[i] = ( packed >> i ) & 1;
+            interrupts_enabled = true;
+            break;
+        }
+        case 3: // idle
+            waitForInterrupt();
+            break;
+        case 4: // sti
+            interrupts_enabled = true;
+            break;
+        case 5: // cli
+            interrupts_enabled = false;
+            break;
+        default:
+            Error("Unexpected value in instruction");
+    }
+}
+
+// update interrupts_armed after a change of the vectors or of the timer
+void VM::updateInterruptSources( void )
+{
+    bool timer = timer_period != std::chrono::steady_clock::duration::zero() and vectors[IRQ_TIMER] != NO_VECTOR;
+    bool input = vectors[IRQ_INPUT] != NO_VECTOR;
+    bool present = present_period != std::chrono::steady_clock::duration::zero();
+    bool armed = timer or input or present;
+    redispatch = redispatch or armed != interrupts_armed;
+    interrupts_armed = armed;
+}
+
+// clock of the guest : the host clock, plus the time skipped in virtual time
+std::chrono::steady_clock::time_point VM::now( void ) const
+{
+    return std::chrono::steady_clock::now() + skipped;
+}
+
+// present the framebuffer if its fixed rate says so
+void VM::presentIfDue( void )
+{
+    if( present_period != std::chrono::steady_clock::duration::zero() and now() >= present_deadline )
+    {
+        present_deadline = now() + present_period;
+        presentFramebuffer();
+    }
+}
+
+// PRESENT the framebuffer
+void VM::executePRESENT( const uint32_t& )
+{
+    if( framebuffer == nullptr )
+        Error( "PRESENT without framebuffer ( see .framebuffer )" );
+    presentFramebuffer();
+}
+
+// raise the interrupts whose event happened, also presents the framebuffer at its rate, then deliver the first one if allowed
+void VM::checkInterrupts( void )
+{
+    presentIfDue();
+    if( not interrupts_enabled )
+        return;
+
+    if( timer_period != std::chrono::steady_clock::duration::zero() and vectors[IRQ_TIMER] != NO_VECTOR
+        and now() >= timer_deadline )
+    {
+        timer_deadline += timer_period;
+        deliverInterrupt( IRQ_TIMER );
+    }
+    else if( vectors[IRQ_INPUT] != NO_VECTOR )
+    {
+        if( io->inputReady( 0 )) // level triggered : raised as long as the handler has not read the input
+            deliverInterrupt( IRQ_INPUT );
+    }
+}
+
+// push flags and ip, then jump to the handler of the vector
+void VM::deliverInterrupt( uint8_t vector )
+{
+    uint16_t packed = 0;
+    for( int i = 0; i < F_COUNT; i++ )
+        packed = static_cast<uint16_t>( packed | ( flags[i] << i ));
+
+    executePUSH( 0x91000000 | packed );
+    pushReturnAddress( programCounter() );
+    setProgramCounter( vectors[vector] );
+    interrupts_enabled = false;     // until IRET
+}
+
+// block the host thread until the next timer deadline or until the input is ready, then deliver the interrupt
+void VM::waitForInterrupt( void )
+{
+    using namespace std::chrono;
+    bool timer = timer_period != steady_clock::duration::zero() and vectors[IRQ_TIMER] != NO_VECTOR;
+    if( not timer and vectors[IRQ_INPUT] == NO_VECTOR )
+        Error( "IDLE without any interrupt source would never return" );
+    if( not interrupts_enabled )
+        Error( "IDLE with interrupts disabled would never return" );
+    output->flush();
+
+    if( cooperative ) // run() returns, IDLE runs again until an interrupt is delivered, see skipIdle()
+    {
+        wake_time = timer ? timer_deadline : steady_clock::time_point::max();
+        suspendInstruction( IDLING );
+        return;
+    }
+
+    while( interrupts_enabled ) // delivering an interrupt disables them
+    {
+        if( virtual_time and timer ) // jump to the deadline, unless the input is ready already
+        {
+            if( vectors[IRQ_INPUT] == NO_VECTOR or not io->inputReady( 0 ))
+                skipped += std::max( steady_clock::duration::zero(), timer_deadline - now() );
+        }
+        else if( vectors[IRQ_INPUT] != NO_VECTOR )
+        {
+            int timeout = -1; // wait for the input forever if there is no timer
+            if( timer )
+                timeout = static_cast<int>( std::max<milliseconds::rep>( 0, ceil<milliseconds>( timer_deadline - now() ).count() ));
+            io->inputReady( timeout );
+        }
+        else
+            std::this_thread::sleep_until( timer_deadline - skipped );
+
+        checkInterrupts();
+    }
+}
+
+// BANK : map a physical bank onto a window of the address space
+// the mapping is done by the host MMU, so memory accesses cost the same whether banks are switched or not
+void VM::executeBANK( const uint32_t& instruction )
+{
+    uint16_t mode   = ( instruction & 0x00F00000 ) >> 20;   // 0: immediate bank | 2: bank in register
+    uint16_t window = ( instruction & 0x000F0000 ) >> 16;   // window of the address space
+    uint16_t src    = ( instruction & 0x000000F0 ) >>  4;   // register holding the bank
+    uint16_t bank   = ( instruction & 0x0000FFFF );         // immediate bank
+
+    if( mode == 2 )
+        bank = reg[src];
+    memory_block->mapBank( static_cast<uint8_t>( window ), bank );
+}
+
+// far JUMP and CALL, the 32 bits target is stored in the next program word
+// modes and condition are the same as executeJUMP
+void VM::executeFAR( const uint32_t& instruction )
+{
+    uint16_t mode    = ( instruction & 0x00F00000 ) >> 20;  // 0: jump | 1: call | 3: conditionnal jump | 4: conditionnal call
+    uint8_t  cpuFlag = ( instruction & 0x000F0000 ) >> 16;  // cpu flag used as condition
+    bool     sign    = ( instruction & 0x00000001 );        // 1: if | 0: ifnot
+
+    uint32_t target = ( *program )[programCounter()];
+    setProgramCounter( programCounter() + 1 ); // skip the extension word
+
+    bool taken = ( mode == 0 or mode == 1 or sign == flags[cpuFlag] );
+    if( not taken )
+        return;
+
+    if( mode == 1 or mode == 4 )
+        pushReturnAddress( programCounter() );
+    setProgramCounter( target );
+}
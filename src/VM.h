@@ -1,8 +1,21 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <array>
+#include <functional>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include "basmDefinition.h"
+#include "natives.h"
+#include "Heap.h"
+#include "Channel.h"
+#include "Memory.h"
+#include "IO.h"
+#include "Output.h"
+#include "Framebuffer.h"
 
 
 //  +---------------------------+
@@ -15,8 +28,24 @@ OP getInstruction( const uint32_t& instruction );
 // take a string and return if possible the correct 16 bits number
 uint16_t parseInputValue( std::string value );
 
+// host callback bound to a native slot, called by the 'native' instruction
+using NativeFunction = std::function<void( NativeContext& )>;
+
+// aggregated measures of a guest region delimited by 'mark begin N' and 'mark end N'
+struct ProfileRegion
+{
+    uint64_t count        = 0;  // amount of completed begin/end pairs
+    uint64_t instructions = 0;  // instructions retired inside the region
+    std::chrono::nanoseconds time{ 0 };  // wall time spent inside the region
+    uint64_t start_retired = 0; // retired counter at the last 'mark begin'
+    std::chrono::steady_clock::time_point start_time;
+    bool     open         = false;
+};
+
 class VM
 {
+    // runs VMs in lockstep, their registers and flags moved to its own arrays
+    friend class LockstepEngine;
 
 //  +---------------------+
 //  |    VM attributes    |
@@ -28,18 +57,143 @@ public:
     uint16_t reg[ R_COUNT ];
 
 private:
-    // array of word addresses  (16 bits offset)
-    // ~ amount to 130 ko of memory, no need for dynamic allocation
-    uint16_t memory[UINT16_MAX];    
-    // no program size limit, dinamic array for less memory impact on average
-    std::vector<uint32_t> program;
+    // array of word addresses  (16 bits offset), ~ amount to 130 ko of memory
+    // allocated by initialize(), shared with every thread started by SPAWN
+    std::shared_ptr<GuestMemory> memory_block;
+    uint16_t* memory = nullptr;     // memory_block->data(), every instruction goes through it
+    // no program size limit, shared with every thread started by SPAWN
+    std::shared_ptr<const std::vector<uint32_t>> program;
     // amount of reserved space in memory ( maybe useful for later ? )
     const uint16_t RESERVED_SPACE = 0;
     // array containing the CPU flags, access like flags[ZRO]
     bool flags[ F_COUNT ];
     // used to generate random numbers
     uint16_t rnd_seed;
+    // high 16 bits of the 32 bits instruction pointer, ip holding the low 16 bits
+    uint16_t code_segment = 0;
+    // programs larger than 65536 instructions push 32 bits return addresses ( two words, high word first )
+    bool wide_calls = false;
+    // console read by INPUT and written by the output buffer, a terminal by default
+    std::shared_ptr<IOBackend> io;
+    // text written by DISP, flushed by CLS, WAIT, INPUT, IDLE and when the program halts
+    std::shared_ptr<OutputBuffer> output;
+    // the root VM runs a writer thread for the output while start() runs
+    bool async_output = false;
+    // set while run() executes : WAIT, INPUT and IDLE suspend the program instead of blocking
+    bool cooperative = false;
+    // why the last instruction suspended the program, RUNNING otherwise
+    enum Suspension { RUNNING, SLEEPING, WAITING_INPUT, IDLING, WAITING_CHANNEL, WAITING_THREAD } suspension = RUNNING;
+    // end of the suspension for SLEEPING and IDLING
+    std::chrono::steady_clock::time_point wake_time;
+    // WAITING_CHANNEL : the channel which was full ( sending ) or empty
+    Channel* waiting_channel = nullptr;
+    bool waiting_send = false;
+    // words of a SENDM or RECVM moved before the channel suspended it
+    uint32_t channel_done = 0;
+    // host functions callable from the guest, indexed by the slot encoded in the instruction
+    std::array<NativeFunction, NATIVE_COUNT> natives;
+    // size-class allocator serving ALLOC and FREE, configured by configureHeap or by the first ALLOC
+    Heap heap;
+    // sp before the first push, a stack starting below the heap must not grow into it
+    uint16_t stack_start = 0;
+    // highest sp a PUSH may reach, below the heap or the data if the stack starts below them. Updated
+    // with the heap by another thread when an ALLOC configures it, hence atomic ( relaxed, a plain load )
+    std::atomic<uint16_t> stack_limit{ UINT16_MAX - 1 };
+    // initialized data copied by load(), [data_start, data_end[, empty if the program has none
+    uint32_t data_start = 0;
+    uint32_t data_end = 0;
+    // amount of instructions executed, readable by the guest with CYCLES. Counted as instructions run
+    // only by the exact dispatch loop ( profiling, CYCLES in the program, interrupts armed ), otherwise
+    // added once the loop ends
+    uint64_t retired = 0;
+    // the program contains CYCLES, set by load()
+    bool reads_counter = false;
+    // origin of the clock read by the guest with CLOCK
+    std::chrono::steady_clock::time_point clock_origin;
+    // WAIT and IDLE advance a simulated clock instead of sleeping
+    bool virtual_time = false;
+    // time skipped by WAIT and IDLE in virtual time, added to the host clock by now()
+    std::chrono::steady_clock::duration skipped{ 0 };
+    // MARK instructions are ignored unless profiling is enabled
+    bool profiling = false;
+    // regions measured by MARK, indexed by the region number
+    std::vector<ProfileRegion> regions;
+
+    // a guest thread started by SPAWN : its own registers, flags and stack, over the same memory
+    struct GuestThread
+    {
+        std::unique_ptr<VM> context;
+        std::thread thread;
+        bool joined = false;
+        std::atomic<bool> finished{ false };    // its program halted, join would not block
+    };
+    // WAITING_THREAD : the thread JOIN waits for, nullptr once the program halted and waits for every thread
+    GuestThread* waiting_thread = nullptr;
+    // VM created by the host, owning the heap and the threads, nullptr if this VM is the root itself
+    VM* root = nullptr;
+    // threads started by SPAWN ( root only ), thread id is the index + 1
+    std::vector<std::unique_ptr<GuestThread>> threads;
+    mutable std::mutex threads_mutex;
+    // contexts of the PFOR workers, kept from one PFOR to the next
+    std::vector<std::unique_ptr<VM>> pfor_contexts;
+    // serialize ALLOC and FREE between threads ( root only )
+    std::mutex heap_mutex;
+
+public:
+    // amount of channel numbers usable by SEND and RECV
+    static const uint8_t CHANNEL_COUNT = 16;
+    // stack words given to each PFOR worker, reserved above the stack of the caller
+    static const uint16_t PFOR_STACK_SIZE = 256;
+    // interrupt vectors, IRQ_TIMER and IRQ_INPUT are raised by the VM
+    static const uint8_t  IRQ_TIMER = 0;
+    static const uint8_t  IRQ_INPUT = 1;
+    static const uint8_t  VECTOR_COUNT = 16;
+    // interrupts are polled every INTERRUPT_PERIOD instructions ( power of two )
+    static const uint32_t INTERRUPT_PERIOD = 1024;
 
+private:
+    // channels wired by the host, indexed by the number encoded in SEND and RECV
+    std::array<std::shared_ptr<Channel>, CHANNEL_COUNT> channels;
+
+    // handler address of every interrupt, NO_VECTOR if not set
+    static const uint32_t NO_VECTOR = UINT32_MAX;
+    std::array<uint32_t, VECTOR_COUNT> vectors;
+    // true when at least one interrupt source is armed, the dispatch loop polls them only then
+    bool interrupts_armed = false;
+    // interrupts_armed changed : the dispatch loop returns to execute() which selects the other one
+    bool redispatch = false;
+    // cleared by CLI and while a handler runs
+    bool interrupts_enabled = true;
+    // periodic timer armed by TIMER, disarmed when period is 0
+    std::chrono::steady_clock::duration timer_period{ 0 };
+    std::chrono::steady_clock::time_point timer_deadline;
+
+    // memory region drawn by PRESENT, shared with every thread, nullptr if not configured
+    std::shared_ptr<Framebuffer> framebuffer;
+    // the root VM also presents the framebuffer at a fixed rate, disabled when period is 0
+    std::chrono::steady_clock::duration present_period{ 0 };
+    std::chrono::steady_clock::time_point present_deadline;
+
+    // state restored by reset(), memory apart
+    struct ResetPoint
+    {
+        uint16_t reg[ R_COUNT ];
+        bool flags[ F_COUNT ];
+        uint16_t rnd_seed;
+        uint16_t code_segment;
+        uint64_t retired;
+        Heap heap;
+        std::array<uint32_t, VECTOR_COUNT> vectors;
+        bool interrupts_enabled;
+        std::chrono::steady_clock::duration timer_period;
+    };
+    std::unique_ptr<ResetPoint> reset_point;
+
+public:
+    // heap region of the first ALLOC when the host did not configure one : the last quarter of the
+    // memory, far from the stack growing from 0
+    static const uint16_t DEFAULT_HEAP_BASE = 0xC000;
+    static const uint16_t DEFAULT_HEAP_SIZE = UINT16_MAX - DEFAULT_HEAP_BASE;
 
 
 //    All functions are public
@@ -52,11 +206,47 @@ public:
     void initialize( void );
 
     // load instructions in program vector from another vector (passed by the compiler)
-    void load( const std::vector<uint32_t>& instructionArray );
+    // and copy the initialized data, if any, in memory from data_base
+    void load( const std::vector<uint32_t>& instructionArray, uint16_t data_base = 0, const std::vector<uint16_t>& data = {} );
+
+    // same, sharing a program with other VMs instead of copying it
+    void load( std::shared_ptr<const std::vector<uint32_t>> instructions, uint16_t data_base = 0, const std::vector<uint16_t>& data = {} );
 
     // execute the program
     void start( void );
 
+    // why run() returned
+    enum RunState
+    {
+        HALTED,     // the program is over
+        YIELDED,    // the budget of instructions is spent
+        SUSPENDED,  // WAIT, INPUT, IDLE, a channel or JOIN would block : see wakeTime(), waitingInput() and resumable()
+    };
+
+    // execute at most 'budget' instructions without ever blocking the host thread, call again to resume
+    // WAIT, IDLE, an INPUT without data, SEND and RECV on a full or empty channel and JOIN of a running
+    // thread suspend the program instead ( the suspended instruction runs again on the next call ), and
+    // so does the end of a program whose threads still run. PFOR is refused. For schedulers running many
+    // VMs per thread, threads spawned keep blocking their own host thread
+    RunState run( uint64_t budget );
+
+    // a suspended program should not be resumed before this time, time_point::max() if it waits for input only
+    std::chrono::steady_clock::time_point wakeTime( void ) const;
+
+    // a suspended program waits for the console input, see IOBackend::inputReady
+    bool waitingInput( void ) const;
+
+    // a program suspended by a channel or a thread can go on, checked without system calls
+    // false for the other suspensions, see wakeTime() and waitingInput()
+    bool resumable( void ) const;
+
+    // in virtual time, a program suspended by IDLE with a timer jumps to the timer deadline instead of
+    // sleeping, unless its input is ready already. False if the program must wait to be resumed
+    bool skipIdle( void );
+
+    // the console of this VM
+    IOBackend& console( void ) { return *io; }
+
     // display the stack values
     void dispMemoryStack( bool showReserved = false ) const;
 
@@ -66,6 +256,99 @@ public:
 
     // display the content of Flags byte, with the corresponding flags eg ZRO, EQU, ODD etc..
     void dispFlagsRegister( void ) const;
+
+    // bind a host function to a native slot, replacing any previous one ( built-ins included )
+    void registerNative( uint16_t slot, NativeFunction function );
+
+    // choose the memory region managed by ALLOC and FREE, every live block is forgotten
+    void configureHeap( uint16_t base, uint32_t size );
+
+    // allocation and fragmentation statistics of the guest heap
+    const HeapStats& heapStats( void ) const;
+
+    // display the heap statistics
+    void dispHeapStats( void ) const;
+
+    // enable or disable the aggregation of MARK regions
+    void enableProfiling( bool enable );
+
+    // amount of instructions executed since initialize()
+    uint64_t instructionsRetired( void ) const;
+
+    // display count, instructions and wall time of every region used
+    void dispProfile( void ) const;
+
+    // wait for every thread started by SPAWN, called by start() when the program halts
+    void joinThreads( void );
+
+    // read INPUT from and write DISP to another console than the terminal, call before start()
+    // threads spawned afterward and forks share it
+    void setIOBackend( std::shared_ptr<IOBackend> backend );
+
+    // WAIT and IDLE return right away and advance a simulated clock, read by CLOCK, the timer
+    // and the framebuffer rate, instead of sleeping. Threads spawned afterward and forks inherit it
+    void setVirtualTime( bool enable );
+
+    // time skipped by WAIT and IDLE in virtual time since initialize()
+    std::chrono::steady_clock::duration skippedTime( void ) const;
+
+    // write the output from a thread of its own while the program runs, see OutputBuffer::startWriter
+    // start() waits for the writer to finish before returning
+    void setAsyncOutput( bool enable );
+
+    // replace the flat memory by one using another host backend, call before load()
+    void setMemoryBackend( GuestMemory::Backend backend );
+
+    // replace the memory by a paged one backed by 'banks' banks of 4096 words, call before load()
+    void enablePagedMemory( uint32_t banks );
+
+    // host memory used by this VM, in bytes : guest memory pages committed ( see GuestMemory::residentBytes ),
+    // plus the VM itself, its heap bookkeeping, profile regions and output buffer
+    size_t residentMemory( void ) const;
+
+    // create a VM continuing from the current state : memory pages are shared copy-on-write,
+    // registers, flags, PRNG state, heap and interrupt setup are copied. Call while the VM is stopped,
+    // start() on the child resumes after the HALT that stopped the parent
+    std::unique_ptr<VM> fork( void );
+
+    // seed the PRNG used by RAND, 0 is replaced by 1
+    void setSeed( uint16_t seed );
+
+    // remember the current state as the one restored by reset(), typically right after load()
+    // the memory becomes copy-on-write : flat memory only, without mapped files
+    void setResetPoint( void );
+
+    // restore the state of setResetPoint() for another run of the program, only the memory pages
+    // written since are rewritten. Return the amount of pages restored
+    uint32_t reset( void );
+
+    // write the state of a stopped VM to a file : registers, flags, PRNG, interrupt setup, heap,
+    // program and memory. start() on the restored VM resumes after the HALT that stopped this one
+    void saveSnapshot( const std::string& path ) const;
+
+    // replace initialize() and load() : restore a VM saved by saveSnapshot, the memory is mapped
+    // from the file and only read when touched. The file must not change while the VM runs
+    void loadSnapshot( const std::string& path );
+
+    // map a physical bank onto one of the 16 windows of the address space ( paged memory only )
+    void mapBank( uint8_t window, uint32_t bank );
+
+    // map a host file onto the memory from address ( a multiple of 2048 ), see GuestMemory::mapFile
+    uint32_t mapFile( const std::string& path, uint16_t address, bool writable );
+
+    // show width x height words of the memory from address as a grid of characters, drawn by PRESENT
+    // and 'rate' times per second if rate is not 0. Only the rows changed since are drawn
+    void configureFramebuffer( uint16_t address, uint16_t width, uint16_t height, uint16_t rate = 0 );
+
+    // draw the rows of the framebuffer changed since the last presentation
+    void presentFramebuffer( void );
+
+    // make a channel reachable by the guest under the given number, threads spawned afterward share it
+    void attachChannel( uint8_t number, std::shared_ptr<Channel> channel );
+
+    // wire the output channel of a VM to the input channel of another one, return the created channel
+    static std::shared_ptr<Channel> connect( VM& producer, uint8_t out_number, VM& consumer, uint8_t in_number,
+                                             size_t capacity = 1024, Channel::Kind kind = Channel::SPSC );
     
 
 private:
@@ -75,6 +358,48 @@ private:
     // generate a 16bit random number
     uint16_t xorshift16( void );
 
+    // VM owning the resources shared between threads
+    VM& rootVM( void );
+
+    // compute stack_limit from stack_start, the heap and the data of the root VM
+    void updateStackLimit( void );
+
+    // stop the VM if the heap overlaps the initialized data or the start of the stack ( root only )
+    void checkLayout( void ) const;
+
+    // update stack_limit in the root VM and every context sharing its memory, heap_mutex held ( root only )
+    void updateStackLimits( void );
+
+    // stop the VM, PUSH or CALL reached stack_limit
+    void stackOverflow( void ) const;
+
+    // create a context sharing memory, program and natives, starting with a copy of registers and flags
+    std::unique_ptr<VM> createContext( void );
+
+    // every thread spawned has halted, joining them would not block ( root only )
+    bool threadsFinished( void ) const;
+
+    // run() stops before the current instruction, executed again on the next call
+    void suspendInstruction( Suspension reason );
+
+    // give a context the memory, program, console, natives... this VM uses now
+    void shareWith( VM& context );
+
+    // push the address of the HALT closing the program, so that a 'ret' from the current routine stops the VM
+    void pushReturnToHalt( void );
+
+    // 32 bits address of the next instruction
+    uint32_t programCounter( void ) const;
+
+    // continue the execution at a 32 bits address
+    void setProgramCounter( uint32_t address );
+
+    // push a return address : one word, or two for programs larger than 65536 instructions
+    void pushReturnAddress( uint32_t address );
+
+    // pop a return address pushed by pushReturnAddress and continue the execution there
+    void popReturnAddress( void );
+
 //  +-----------------------------------+
 //  |    OP Interpretation Functions    |
 //  +-----------------------------------+
@@ -107,7 +432,21 @@ private:
     void executeJUMP( const uint32_t& instruction );
 
     // redirect to the correct function depending on the instruction code contained in the first 8 bits
-    bool processInstruction( const uint32_t& instruction );
+    // false on HALT, a suspension, or a change of interrupts_armed ( see redispatch ). 'retired' is
+    // counted by the caller. Only used by the dispatch loops, which inline it
+    inline bool processInstruction( const uint32_t& instruction );
+
+    // execute at most 'budget' instructions with the dispatch loop the program needs, switching loops
+    // when interrupts are armed or disarmed. False once the program halted or is suspended
+    bool execute( uint64_t budget );
+
+    // one dispatch loop, 'budget' is decreased by the amount executed. EXACT counts 'retired' as
+    // instructions run and polls the interrupts, otherwise 'retired' is updated once at the end
+    template<bool EXACT>
+    bool dispatch( uint64_t& budget );
+
+    // end of the program : join the threads, present the last frame and write the output
+    void finish( void );
 
 
 //  +------------------------------+
@@ -135,6 +474,57 @@ private:
     // analyse second hex value to execute appropriate instruction 
     void selectMISC( const uint32_t& instruction );
 
+    // call the host function bound to the slot contained in the last 16 bits
+    void executeNATIVE( const uint32_t& instruction );
+
+    // ALLOC a block from the heap and put its address in a register, or FREE it
+    void executeHEAP( const uint32_t& instruction );
+
+    // CYCLES and CLOCK read 32 bits counters into two registers, MARK delimits profiled regions
+    void executePROFILE( const uint32_t& instruction );
+
+    // SPAWN a thread at a label, JOIN it, or issue a memory FENCE
+    void executeTHREAD( const uint32_t& instruction );
+
+    // atomic XADD, XCHG and CAS on a dereferenced register
+    void executeATOMIC( const uint32_t& instruction );
+
+    // SEND and RECV words or memory blocks on a channel, blocking or not
+    void executeCHANNEL( const uint32_t& instruction );
+
+    // PFOR : call a routine for every index of a range, split across the host thread pool
+    void executePFOR( const uint32_t& instruction );
+
+    // IVEC, TIMER, IRET, IDLE, STI and CLI
+    void executeINTERRUPT( const uint32_t& instruction );
+
+    // BANK : map a physical bank onto a window of the address space
+    void executeBANK( const uint32_t& instruction );
+
+    // far JUMP and CALL, the 32 bits target is stored in the next program word
+    void executeFAR( const uint32_t& instruction );
+
+    // PRESENT the framebuffer
+    void executePRESENT( const uint32_t& instruction );
+
+    // present the framebuffer if its fixed rate says so
+    void presentIfDue( void );
+
+    // raise the interrupts whose event happened, then deliver the first one if allowed
+    void checkInterrupts( void );
+
+    // push flags and ip, then jump to the handler of the vector
+    void deliverInterrupt( uint8_t vector );
+
+    // block the host thread until the next timer deadline or until the input is ready
+    void waitForInterrupt( void );
+
+    // update interrupts_armed after a change of the vectors or of the timer
+    void updateInterruptSources( void );
+
+    // clock of the guest : the host clock, plus the time skipped in virtual time
+    std::chrono::steady_clock::time_point now( void ) const;
+
 };
 
 
@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <utility>
+
+#include "VMPool.h"
+#include "IO.h"
+
+
+// index of the worker running on this thread, jobs it submits go to its own deque
+static thread_local const VMPool* current_pool = nullptr;
+static thread_local unsigned current_worker = 0;
+
+// start 'count' worker threads, 0 : one per core
+VMPool::VMPool( unsigned count )
+{
+    if( count == 0 )
+        count = std::max( 1u, std::thread::hardware_concurrency() );
+    for( unsigned i = 0; i < count; i++ )
+        workers.push_back( std::make_unique<Worker>() );
+    for( unsigned i = 0; i < count; i++ )
+        threads.emplace_back( &VMPool::workerLoop, this, i );
+}
+
+// run the jobs already submitted, then stop the workers
+VMPool::~VMPool()
+{
+    {
+        std::lock_guard<std::mutex> lock( sleep_mutex );
+        stopping = true;
+    }
+    wake.notify_all();
+    for( std::thread& t : threads )
+        t.join();
+}
+
+// queue a job, its result is delivered through the future
+std::future<VMResult> VMPool::submit( VMJob job )
+{
+    auto promise = std::make_shared<std::promise<VMResult>>();
+    std::future<VMResult> result = promise->get_future();
+    submit( std::move( job ), [promise]( VMResult r ) { promise->set_value( std::move( r )); } );
+    return result;
+}
+
+// queue a job, 'done' is called with its result by the worker which ran it
+void VMPool::submit( VMJob job, Callback done )
+{
+    // a worker keeps the jobs it creates, others spread them over the deques
+    size_t target = current_pool == this ? current_worker : next_worker.fetch_add( 1, std::memory_order_relaxed ) % workers.size();
+    {
+        std::lock_guard<std::mutex> lock( workers[target]->mutex );
+        workers[target]->tasks.push_back( Task{ std::move( job ), std::move( done ) } );
+    }
+    pending.fetch_add( 1, std::memory_order_release );
+    {
+        std::lock_guard<std::mutex> lock( sleep_mutex ); // a worker going to sleep has seen pending, or sees it now
+    }
+    wake.notify_one();
+}
+
+// activity of every worker, indexed like VMResult::worker
+std::vector<VMWorkerStats> VMPool::stats( void )
+{
+    std::vector<VMWorkerStats> all;
+    for( auto& worker : workers )
+    {
+        std::lock_guard<std::mutex> lock( worker->mutex );
+        all.push_back( worker->stats );
+    }
+    return all;
+}
+
+// take jobs, from its own deque first, until the pool stops
+void VMPool::workerLoop( unsigned worker )
+{
+    current_pool = this;
+    current_worker = worker;
+    Task task;
+    for( ;; )
+    {
+        if( take( worker, task ))
+        {
+            VMResult result = execute( task.job, worker );
+            {
+                std::lock_guard<std::mutex> lock( workers[worker]->mutex );
+                VMWorkerStats& stats = workers[worker]->stats;
+                stats.jobs++;
+                stats.instructions += result.instructions;
+                stats.busy += result.time;
+            }
+            if( task.done )
+                task.done( std::move( result ));
+            task = Task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock( sleep_mutex );
+        wake.wait( lock, [this]{ return stopping or pending.load( std::memory_order_acquire ) > 0; } );
+        if( stopping and pending.load( std::memory_order_acquire ) == 0 )
+            return;
+    }
+}
+
+// take a job from the deque of 'worker', or steal one from another. Return false if there is none
+bool VMPool::take( unsigned worker, Task& task )
+{
+    if( pending.load( std::memory_order_acquire ) == 0 )
+        return false;
+
+    {
+        Worker& own = *workers[worker];
+        std::lock_guard<std::mutex> lock( own.mutex );
+        if( not own.tasks.empty() ) // newest first : its data is the most likely to be in cache
+        {
+            task = std::move( own.tasks.back() );
+            own.tasks.pop_back();
+            pending.fetch_sub( 1, std::memory_order_relaxed );
+            return true;
+        }
+    }
+
+    for( size_t i = 1; i < workers.size(); i++ ) // visit the others starting with the next one
+    {
+        Worker& victim = *workers[( worker + i ) % workers.size()];
+        std::unique_lock<std::mutex> lock( victim.mutex, std::try_to_lock );
+        if( not lock.owns_lock() or victim.tasks.empty() ) // busy deque : try another one
+            continue;
+        task = std::move( victim.tasks.front() ); // oldest : the owner works on the other end
+        victim.tasks.pop_front();
+        lock.unlock();
+        pending.fetch_sub( 1, std::memory_order_relaxed );
+        std::lock_guard<std::mutex> own_lock( workers[worker]->mutex );
+        workers[worker]->stats.stolen++;
+        return true;
+    }
+    return false;
+}
+
+// run a job in a fresh VM
+VMResult VMPool::execute( VMJob& job, unsigned worker )
+{
+    auto start = std::chrono::steady_clock::now();
+
+    auto console = std::make_shared<MemoryBackend>( std::move( job.input ));
+    VM vm;
+    vm.initialize();
+    vm.setIOBackend( console );
+    if( job.seed != 0 )
+        vm.setSeed( job.seed );
+    vm.load( job.program, job.data_base, job.data );
+    if( job.setup )
+        job.setup( vm );
+    vm.start();
+
+    VMResult result;
+    result.output = console->output();
+    result.instructions = vm.instructionsRetired();
+    result.time = std::chrono::steady_clock::now() - start;
+    result.worker = worker;
+    return result;
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "VM.h"
+
+
+//  +-------------------------+
+//  |        VM Pool          |
+//  +-------------------------+
+
+// a program to run in a fresh VM, with the text read by INPUT
+struct VMJob
+{
+    std::shared_ptr<const std::vector<uint32_t>> program;   // shared by every job running it
+    uint16_t data_base = 0;                                 // initialized data, see Assembler::data
+    std::vector<uint16_t> data;
+    std::string input;
+    uint16_t seed = 0;                                      // PRNG seed, 0 : from host entropy, different for every job
+    std::function<void( VM& )> setup;                       // optional, called before the program starts
+};
+
+// what a job left behind
+struct VMResult
+{
+    std::string output;                                     // text written by DISP
+    uint64_t instructions = 0;
+    std::chrono::steady_clock::duration time{ 0 };          // time spent running the program
+    unsigned worker = 0;
+};
+
+// activity of one worker since the pool started
+struct VMWorkerStats
+{
+    uint64_t jobs = 0;
+    uint64_t stolen = 0;                                    // jobs taken from the deque of another worker
+    uint64_t instructions = 0;
+    std::chrono::steady_clock::duration busy{ 0 };
+};
+
+// runs independent programs on a fixed set of host threads. Each worker owns a deque of jobs : it takes
+// the newest job of its own deque, and when it is empty steals the oldest job of another worker
+// Every job runs in its own VM, with a MemoryBackend console. A guest error still ends the process
+class VMPool
+{
+public:
+    using Callback = std::function<void( VMResult )>;
+
+private:
+    struct Task
+    {
+        VMJob job;
+        Callback done;
+    };
+
+    // keep the deques of two workers on different cache lines
+    struct alignas( 64 ) Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;         // the owner takes from the back, thieves from the front
+        VMWorkerStats stats;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next_worker{ 0 };   // deque receiving the next job submitted from outside
+    std::atomic<size_t> pending{ 0 };       // jobs submitted and not taken yet
+    std::mutex sleep_mutex;
+    std::condition_variable wake;           // signal new jobs to idle workers
+    bool stopping = false;
+
+public:
+    // start 'count' worker threads, 0 : one per core
+    explicit VMPool( unsigned count = 0 );
+
+    // run the jobs already submitted, then stop the workers
+    ~VMPool();
+
+    VMPool( const VMPool& ) = delete;
+    VMPool& operator=( const VMPool& ) = delete;
+
+    // queue a job, its result is delivered through the future
+    std::future<VMResult> submit( VMJob job );
+
+    // queue a job, 'done' is called with its result by the worker which ran it
+    void submit( VMJob job, Callback done );
+
+    unsigned size( void ) const { return static_cast<unsigned>( workers.size() ); }
+
+    // activity of every worker, indexed like VMResult::worker
+    std::vector<VMWorkerStats> stats( void );
+
+private:
+    // take jobs, from its own deque first, until the pool stops
+    void workerLoop( unsigned worker );
+
+    // take a job from the deque of 'worker', or steal one from another. Return false if there is none
+    bool take( unsigned worker, Task& task );
+
+    // run a job in a fresh VM
+    VMResult execute( VMJob& job, unsigned worker );
+};
@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "VMScheduler.h"
+#include "IO.h"
+#include "misc.h"
+
+
+// 'budget' : instructions executed by a VM before the next one runs
+VMScheduler::VMScheduler( uint64_t instructions )
+: budget( instructions )
+, wheel( WHEEL_SLOTS )
+, origin( std::chrono::steady_clock::now() )
+, epoll_fd( epoll_create1( EPOLL_CLOEXEC ))
+{
+    if( epoll_fd < 0 )
+        Error( "Cannot create the epoll set of the scheduler" );
+}
+
+VMScheduler::~VMScheduler()
+{
+    close( epoll_fd );
+}
+
+// schedule a loaded VM, 'done' is called when its program halts
+void VMScheduler::add( std::unique_ptr<VM> vm, Callback done )
+{
+    auto entry = std::make_unique<Entry>();
+    entry->vm = std::move( vm );
+    entry->done = std::move( done );
+    ready.push_back( std::move( entry ));
+}
+
+// run every VM until all of them halted
+void VMScheduler::run( void )
+{
+    using namespace std::chrono;
+    while( size() > 0 )
+    {
+        steady_clock::time_point now = steady_clock::now();
+        expire( now );
+        pollInput( now );
+        pollBlocked();
+
+        if( ready.empty() ) // everybody waits : until the next tick, or some input
+        {
+            idle();
+            continue;
+        }
+
+        // one turn : every VM ready now gets its budget, the ones woken meanwhile wait for the next turn
+        for( size_t count = ready.size(); count > 0; count-- )
+        {
+            std::unique_ptr<Entry> entry = std::move( ready.front() );
+            ready.pop_front();
+            switch( entry->vm->run( budget ))
+            {
+                case VM::YIELDED:
+                    ready.push_back( std::move( entry ));
+                    break;
+                case VM::SUSPENDED:
+                    suspend( std::move( entry ));
+                    break;
+                default: // HALTED
+                    if( entry->done )
+                        entry->done( *entry->vm );
+                    break;
+            }
+        }
+    }
+}
+
+// VMs not halted yet
+size_t VMScheduler::size( void ) const
+{
+    return ready.size() + sleeping + waiting.size() + blocked.size();
+}
+
+// put a suspended entry in the wheel, with the entries waiting for input or with the blocked ones
+void VMScheduler::suspend( std::unique_ptr<Entry> entry )
+{
+    if( entry->vm->skipIdle() ) // virtual time : the clock of the VM jumps, nothing to wait for
+    {
+        ready.push_back( std::move( entry ));
+        return;
+    }
+    if( entry->vm->waitingInput() ) // the deadline, if any, is checked by pollInput
+    {
+        int fd = entry->vm->console().inputDescriptor();
+        if( fd >= 0 and watched.count( fd ) == 0 )
+        {
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            if( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &event ) != 0 ) // ex: a regular file, always readable
+                fd = -1;
+        }
+        if( fd >= 0 )
+            watched[fd]++;
+        else
+            unwatched++;
+        entry->input_fd = fd;
+        input_deadline = std::min( input_deadline, entry->vm->wakeTime() );
+        waiting.push_back( std::move( entry ));
+        return;
+    }
+    if( entry->vm->wakeTime() == std::chrono::steady_clock::time_point::max() ) // a channel or a thread
+    {
+        blocked.push_back( std::move( entry ));
+        return;
+    }
+    entry->tick = std::max( current_tick, tickOf( entry->vm->wakeTime() ));
+    wheel[entry->tick % WHEEL_SLOTS].push_back( std::move( entry ));
+    sleeping++;
+}
+
+// move the entries of the wheel whose time has come to the ready queue
+void VMScheduler::expire( std::chrono::steady_clock::time_point now )
+{
+    if( now < origin )
+        return;
+    uint64_t now_tick = static_cast<uint64_t>(( now - origin ) / TICK ); // last tick reached
+    if( now_tick < current_tick )
+        return;
+    // every slot is visited once at most, even if the scheduler is late by more than one turn
+    uint64_t last = std::min( now_tick, current_tick + WHEEL_SLOTS - 1 );
+    for( uint64_t tick = current_tick; tick <= last and sleeping > 0; tick++ )
+    {
+        std::vector<std::unique_ptr<Entry>>& slot = wheel[tick % WHEEL_SLOTS];
+        size_t kept = 0;
+        for( std::unique_ptr<Entry>& entry : slot )
+        {
+            if( entry->tick <= now_tick )
+            {
+                ready.push_back( std::move( entry ));
+                sleeping--;
+            }
+            else // a later turn of the wheel
+                slot[kept++] = std::move( entry );
+        }
+        slot.resize( kept );
+    }
+    current_tick = now_tick + 1;
+}
+
+// move the entries whose input is ready, or whose deadline passed, to the ready queue
+void VMScheduler::pollInput( std::chrono::steady_clock::time_point now )
+{
+    if( waiting.empty() )
+        return;
+
+    // one system call for every descriptor watched, level triggered : what is not read stays reported
+    std::vector<int> readable;
+    if( not watched.empty() )
+    {
+        epoll_event events[64];
+        int count = epoll_wait( epoll_fd, events, 64, 0 );
+        for( int i = 0; i < count; i++ )
+            readable.push_back( events[i].data.fd );
+    }
+    if( readable.empty() and unwatched == 0 and now < input_deadline ) // nothing changed
+        return;
+
+    size_t kept = 0;
+    input_deadline = std::chrono::steady_clock::time_point::max();
+    for( std::unique_ptr<Entry>& entry : waiting )
+    {
+        bool go = now >= entry->vm->wakeTime();
+        if( entry->input_fd < 0 ) // a console in memory, no system call
+            go = go or entry->vm->console().inputReady( 0 );
+        else
+            go = go or std::find( readable.begin(), readable.end(), entry->input_fd ) != readable.end();
+
+        if( not go )
+        {
+            input_deadline = std::min( input_deadline, entry->vm->wakeTime() );
+            waiting[kept++] = std::move( entry );
+            continue;
+        }
+        if( entry->input_fd < 0 )
+            unwatched--;
+        else if( --watched[entry->input_fd] == 0 )
+        {
+            epoll_ctl( epoll_fd, EPOLL_CTL_DEL, entry->input_fd, nullptr );
+            watched.erase( entry->input_fd );
+        }
+        ready.push_back( std::move( entry ));
+    }
+    waiting.resize( kept );
+}
+
+// move the entries blocked by a channel or JOIN which can go on to the ready queue
+void VMScheduler::pollBlocked( void )
+{
+    size_t kept = 0;
+    for( std::unique_ptr<Entry>& entry : blocked )
+    {
+        if( entry->vm->resumable() )
+            ready.push_back( std::move( entry ));
+        else
+            blocked[kept++] = std::move( entry );
+    }
+    blocked.resize( kept );
+}
+
+// nothing is ready : wait for the next tick, or for input on a watched descriptor
+void VMScheduler::idle( void )
+{
+    using namespace std::chrono;
+    steady_clock::time_point tick = origin + TICK * static_cast<steady_clock::rep>( current_tick );
+    if( watched.empty() )
+    {
+        std::this_thread::sleep_until( tick );
+        return;
+    }
+    int timeout = static_cast<int>( std::max<milliseconds::rep>( 0, ceil<milliseconds>( tick - steady_clock::now() ).count() ));
+    epoll_event event;
+    epoll_wait( epoll_fd, &event, 1, timeout ); // the event stays reported for pollInput
+}
+
+// tick of the wheel containing 'time', rounded up
+uint64_t VMScheduler::tickOf( std::chrono::steady_clock::time_point time ) const
+{
+    if( time == std::chrono::steady_clock::time_point::max() )
+        return UINT64_MAX;
+    if( time <= origin )
+        return 0;
+    return static_cast<uint64_t>(( time - origin + TICK - std::chrono::steady_clock::duration( 1 )) / TICK );
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "VM.h"
+
+
+//  +-------------------------+
+//  |      VM Scheduler       |
+//  +-------------------------+
+
+// runs many VMs on the calling thread ( M:N with one scheduler per thread ) : each VM executes
+// a budget of instructions with VM::run, then gives the hand to the next one. A VM suspended by WAIT
+// or IDLE sleeps in a timer wheel, one suspended by INPUT is resumed once its console has input
+// ( consoles reading a file descriptor are watched by a single epoll set ), one suspended by a channel
+// or JOIN once it can go on, so mostly idle VMs cost nothing but their memory
+class VMScheduler
+{
+public:
+    static const uint64_t DEFAULT_BUDGET = 4096;    // instructions executed before yielding
+
+    // called with the VM once its program halted, the VM is destroyed afterward
+    using Callback = std::function<void( VM& )>;
+
+private:
+    struct Entry
+    {
+        std::unique_ptr<VM> vm;
+        Callback done;
+        uint64_t tick = 0;          // tick of the timer wheel resuming it
+        int input_fd = -1;          // descriptor watched while it waits for input, -1 if its console has none
+    };
+
+    // hashed timer wheel : an entry goes to the slot of its tick, modulo the amount of slots
+    // Entries whose tick is more than one turn ahead stay in their slot until their turn
+    static const size_t WHEEL_SLOTS = 4096;
+    static constexpr std::chrono::steady_clock::duration TICK = std::chrono::milliseconds( 1 );
+
+    uint64_t budget;
+    std::deque<std::unique_ptr<Entry>> ready;
+    std::vector<std::vector<std::unique_ptr<Entry>>> wheel;
+    std::chrono::steady_clock::time_point origin;   // time of tick 0
+    uint64_t current_tick = 0;                      // next tick to expire
+    size_t sleeping = 0;                            // entries in the wheel
+    std::vector<std::unique_ptr<Entry>> waiting;    // entries waiting for input, maybe with a deadline
+    int epoll_fd;                                   // descriptors of the consoles waited for
+    std::unordered_map<int, size_t> watched;        // descriptor in the epoll set : entries waiting on it
+    size_t unwatched = 0;                           // entries of 'waiting' without descriptor, checked every turn
+    std::chrono::steady_clock::time_point input_deadline = std::chrono::steady_clock::time_point::max();  // earliest of 'waiting'
+    std::vector<std::unique_ptr<Entry>> blocked;    // entries suspended by a channel or JOIN
+
+public:
+    // 'budget' : instructions executed by a VM before the next one runs
+    explicit VMScheduler( uint64_t budget = DEFAULT_BUDGET );
+    ~VMScheduler();
+
+    VMScheduler( const VMScheduler& ) = delete;
+    VMScheduler& operator=( const VMScheduler& ) = delete;
+
+    // schedule a loaded VM, 'done' is called when its program halts
+    void add( std::unique_ptr<VM> vm, Callback done = nullptr );
+
+    // run every VM until all of them halted, VMs can be added by the callbacks
+    void run( void );
+
+    // VMs not halted yet
+    size_t size( void ) const;
+
+private:
+    // put a suspended entry in the wheel, with the entries waiting for input or with the blocked ones
+    void suspend( std::unique_ptr<Entry> entry );
+
+    // move the entries of the wheel whose time has come to the ready queue
+    void expire( std::chrono::steady_clock::time_point now );
+
+    // move the entries whose input is ready, or whose deadline passed, to the ready queue
+    // only looks at them when the epoll set reports input, a deadline passed, or some have no descriptor
+    void pollInput( std::chrono::steady_clock::time_point now );
+
+    // move the entries blocked by a channel or JOIN which can go on to the ready queue
+    void pollBlocked( void );
+
+    // nothing is ready : wait for the next tick, or for input on a watched descriptor
+    void idle( void );
+
+    uint64_t tickOf( std::chrono::steady_clock::time_point time ) const;
+};
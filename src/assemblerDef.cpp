@@ -100,6 +100,10 @@ namespace basm
             case 19:
                 return "char_value";
             case 20:
+                return "directive";
+            case 21:
+                return "string_value";
+            case 22:
                 return "unkown";
             default:
                 return "unkown";
@@ -36,6 +36,8 @@ namespace basm
         AROBASE,
         DISP_TYPE,
         CHAR_VALUE,
+        DIRECTIVE,
+        STRING_VALUE,
         UNKNOWN
     };
 
@@ -27,7 +27,12 @@ namespace lexer
         return( op=="add"  or op=="sub" or op=="cmp"   or op=="copy" or op=="push" or op=="pop" or op=="mul" 
              or op=="div"  or op=="mod" or op=="and"   or op=="or"   or op=="not"  or op=="xor" or op=="jump" 
              or op=="call" or op=="ret" or op=="input" or op=="disp" or op=="rand" or op=="wait" or op=="exit"
-             or op=="halt" or op=="cls"  );
+             or op=="halt" or op=="cls" or op=="native" or op=="syscall"
+             or op=="alloc" or op=="free" or op=="cycles" or op=="clock" or op=="mark"
+             or op=="spawn" or op=="join" or op=="fence" or op=="xadd" or op=="xchg" or op=="cas"
+             or op=="send" or op=="recv" or op=="trysend" or op=="tryrecv" or op=="sendm" or op=="recvm"
+             or op=="pfor" or op=="ivec" or op=="timer" or op=="iret" or op=="idle" or op=="sti" or op=="cli"
+             or op=="bank" or op=="present" );
     }
 
     // return true if op is a flag from basm, case sensitive ( flags are uppercased eg : EQU, ZRO )
@@ -165,6 +170,22 @@ namespace lexer
         return true;
     }
 
+    // assembler directives, ex: .map
+    bool matchDirective( const string& s )
+    {
+        if( s.length() < 2 or s[0] != '.' ) return false;
+        for( unsigned i=1; i < s.length(); i++ )
+        {
+            if( not isAlpha( s[i] ) ) return false;
+        }
+        return true;
+    }
+
+    // string literals, ex: "Hello world\n"
+    bool matchStringValue( const string& s )
+    {
+        return( s.length() >= 2 and s[0] == '"' and s[s.length() - 1] == '"' );
+    }
 
     // can't have nested functions in C++ :( , this is a work-around
     void endWord( vector<string>& words, string& word ) // push word if not empty
@@ -176,7 +197,10 @@ namespace lexer
 
     bool isEscaped( const string& line, const uint32_t& i )
     {
-        return( i > 0 and line[i-1] == '\\');
+        uint32_t backslashes = 0; // "\\" ends with an escaped backslash, not an escaped quote
+        while( backslashes < i and line[i - 1 - backslashes] == '\\' )
+            backslashes++;
+        return backslashes % 2 == 1;
     }
 
     // REFACTOR 
@@ -243,6 +267,18 @@ namespace lexer
                     endWord( words, word );
                 continue;
             }
+            else if( line[i] == '"' and word == "" ) // string literal, kept whole up to the closing quote
+            {
+                word += line[i];
+                while( ++i < line.length() )
+                {
+                    word += line[i];
+                    if( line[i] == '"' and not isEscaped( line, i ))
+                        break;
+                }
+                endWord( words, word );
+                continue;
+            }
             else if( line[i] == '#') // discard the rest of the line if the char is not escaped
             {
                 if( notEsc )    // stop processing the line
@@ -289,6 +325,8 @@ namespace lexer
         else if( matchBinValue( txt ))     type = BINARY_VALUE;      // try to match binary values
         else if( matchLabelDecl( txt ))    type = LABEL_DECL;        // try to match label declaration ex:  :Hello_World_Proc
         else if( matchLabel( txt))         type = LABEL;             // try to match label call ex: jump Hello_World_Proc
+        else if( matchDirective( txt ))    type = DIRECTIVE;         // try to match directives ex: .map
+        else if( matchStringValue( txt ))  type = STRING_VALUE;      // try to match string literals ex: "Hello"
 
         token ret( txt, type );
         return( ret ); 
@@ -33,6 +33,8 @@ namespace lexer
     bool matchCharValue( const string& s );
     bool matchLabelDecl( const string& s );
     bool matchLabel( const string& s );
+    bool matchDirective( const string& s );
+    bool matchStringValue( const string& s );
 
     // split a string with a delimiter 
     vector<string> splitLine( string line );
@@ -1,5 +1,7 @@
 #include <iostream>
 #include <chrono> 
+#include <fcntl.h>
+#include <unistd.h>
 #include "VM.h"
 #include "Assembler.h"
 
@@ -21,7 +23,91 @@ int main( int argc, char *argv[] )
         exit( -1 );
     }
 
+    // 'main --restore <snapshot>' starts from a snapshot instead of assembling a file
     string file = argv[1];
+    bool restore = file == "--restore";
+    if( restore and argc < 3 )
+    {
+        cerr << "No snapshot to restore. Terminating program." << endl;
+        exit( -1 );
+    }
+    if( restore )
+        file = argv[2];
+
+    // options following the target file
+    bool heap_stats = false;
+    bool profile = false;
+    bool mem_stats = false;
+    string snapshot;        // empty : no snapshot written
+    uint32_t runs = 1;      // runs of the program, the VM is reset between them
+    basm::FramebufferConfig framebuffer;
+    GuestMemory::Backend backend = GuestMemory::ZERO_PAGE;
+    uint32_t banks = 0;     // 0 : flat memory
+    std::vector<basm::FileMap> file_maps;
+    string input_file;      // empty : INPUT reads the terminal
+    string output_file;     // empty : DISP writes to the terminal
+    bool quiet = false;     // discard the output of DISP
+    bool virtual_time = false;
+    bool async_output = false;
+    bool heap_custom = false;
+    uint16_t heap_base = VM::DEFAULT_HEAP_BASE;
+    uint32_t heap_size = VM::DEFAULT_HEAP_SIZE;
+
+    for( int i = restore ? 3 : 2; i < argc; i++ )
+    {
+        string option = argv[i];
+        if( option == "--heap" and i + 2 < argc )   // --heap <base> <size>
+        {
+            heap_base = parseInputValue( argv[++i] );
+            heap_size = parseInputValue( argv[++i] );
+            heap_custom = true;
+        }
+        else if( option == "--heap-stats" )
+            heap_stats = true;
+        else if( option == "--profile" )
+            profile = true;
+        else if( option == "--zero-page" )
+            backend = GuestMemory::ZERO_PAGE;
+        else if( option == "--lazy-memory" )
+            backend = GuestMemory::LAZY;
+        else if( option == "--mem-stats" )
+            mem_stats = true;
+        else if( option == "--snapshot" and i + 1 < argc )  // --snapshot <file>, written when the program halts
+            snapshot = argv[++i];
+        else if( option == "--runs" and i + 1 < argc )   // --runs <count>
+            runs = static_cast<uint32_t>( std::stoul( argv[++i] ));
+        else if( option == "--framebuffer" and i + 3 < argc )   // --framebuffer <address> <width> <height>
+        {
+            framebuffer.enabled = true;
+            framebuffer.address = parseInputValue( argv[++i] );
+            framebuffer.width   = parseInputValue( argv[++i] );
+            framebuffer.height  = parseInputValue( argv[++i] );
+        }
+        else if( option == "--fps" and i + 1 < argc )   // --fps <rate>, presentations of the framebuffer per second
+            framebuffer.rate = parseInputValue( argv[++i] );
+        else if( option == "--banks" and i + 1 < argc )    // --banks <count>
+            banks = static_cast<uint32_t>( std::stoul( argv[++i] ));
+        else if(( option == "--map" or option == "--map-rw" ) and i + 2 < argc )  // --map <file> <address>
+        {
+            string path = argv[++i];
+            file_maps.push_back( basm::FileMap{ path, parseInputValue( argv[++i] ), option == "--map-rw" });
+        }
+        else if( option == "--input" and i + 1 < argc )    // --input <file>, read by INPUT
+            input_file = argv[++i];
+        else if( option == "--output" and i + 1 < argc )   // --output <file>, written by DISP
+            output_file = argv[++i];
+        else if( option == "--quiet" )
+            quiet = true;
+        else if( option == "--async-output" )   // a writer thread writes the output
+            async_output = true;
+        else if( option == "--virtual-time" )   // WAIT advances a simulated clock instead of sleeping
+            virtual_time = true;
+        else
+        {
+            cerr << "Unknown option '" << option << "'. Terminating program." << endl;
+            exit( -1 );
+        }
+    }
 
     // string file = "";
     // cout << "load: ";
@@ -32,12 +118,12 @@ int main( int argc, char *argv[] )
 
     // Instanciate Assambler, assemble instructions
     basm::Assembler assembler;
-    bool s = assembler.assemble( file );
+    bool s = restore or assembler.assemble( file );
 
     // end chrono
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> elapsed = end - start;
-    if( DISP_TIME ) 
+    if( DISP_TIME and not restore )
         cout << "Assembled in " << elapsed.count() << " ms\n";
 
     // terminate program if assemble returned false
@@ -61,9 +147,59 @@ int main( int argc, char *argv[] )
 
     // Instanciate Virtual Machine
     VM vm;
-    vm.initialize();
-    vm.load( assembler.program );
-    vm.start();
+    if( restore ) // memory, heap and program come from the snapshot
+        vm.loadSnapshot( file );
+    else
+    {
+        vm.initialize();
+        if( backend != GuestMemory::ZERO_PAGE )
+            vm.setMemoryBackend( backend );
+        if( banks > 0 )
+            vm.enablePagedMemory( banks );
+        if( heap_custom )
+            vm.configureHeap( heap_base, heap_size );
+    }
+    vm.enableProfiling( profile );
+    vm.setVirtualTime( virtual_time );
+    vm.setAsyncOutput( async_output );
+    if( quiet and input_file.empty() )
+        vm.setIOBackend( std::make_shared<NullBackend>() );
+    else if( quiet or not input_file.empty() or not output_file.empty() )
+    {
+        if( quiet )
+            output_file = "/dev/null";
+        int output_fd = output_file.empty() ? STDOUT_FILENO
+                                            : open( output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+        if( output_fd < 0 )
+        {
+            cerr << "Cannot open '" << output_file << "'. Terminating program." << endl;
+            exit( -1 );
+        }
+        if( input_file.empty() )
+            vm.setIOBackend( std::make_shared<FdBackend>( STDIN_FILENO, output_fd ));
+        else // the input file is mapped and scanned in place
+            vm.setIOBackend( std::make_shared<MappedInputBackend>( input_file, output_fd ));
+    }
+    // files mapped by the command line come after the .map directives, and can cover them
+    file_maps.insert( file_maps.begin(), assembler.file_maps.begin(), assembler.file_maps.end() );
+    for( const basm::FileMap& map : file_maps )
+        vm.mapFile( map.path, map.address, map.writable );
+    if( not restore )
+        vm.load( assembler.program, assembler.data.base, assembler.data.words );
+    // the command line overrides the .framebuffer directive
+    if( not framebuffer.enabled and assembler.framebuffer.enabled )
+        framebuffer = basm::FramebufferConfig{ true, assembler.framebuffer.address, assembler.framebuffer.width,
+                                               assembler.framebuffer.height, framebuffer.rate ? framebuffer.rate : assembler.framebuffer.rate };
+    if( framebuffer.enabled )
+        vm.configureFramebuffer( framebuffer.address, framebuffer.width, framebuffer.height, framebuffer.rate );
+    if( runs > 1 )
+        vm.setResetPoint();
+    for( uint32_t run = 0; run < runs; run++ )
+    {
+        if( run > 0 )
+            vm.reset();
+        vm.start();
+    }
 
     // vm.dispFlagsRegister();
     // vm.dispMemoryStack();
@@ -73,9 +209,22 @@ int main( int argc, char *argv[] )
     elapsed = end - start;
     if( DISP_TIME )
         cout << "\nExecuted in " << elapsed.count() << " ms\n";
+    if( virtual_time )
+    {
+        std::chrono::duration<double, std::milli> skipped = vm.skippedTime();
+        cout << "Simulated time " << ( elapsed + skipped ).count() << " ms, of which " << skipped.count() << " ms waited\n";
+    }
 
     // vm.dispMemoryStack();
 
+    if( heap_stats )
+        vm.dispHeapStats();
+    if( profile )
+        vm.dispProfile();
+    if( not snapshot.empty() )
+        vm.saveSnapshot( snapshot );
+    if( mem_stats )
+        cout << "Resident memory : " << vm.residentMemory() / 1024 << " KB\n";
 
     return 0;
 }
@@ -0,0 +1,50 @@
+#include <algorithm>
+#include <charconv>
+
+#include "natives.h"
+#include "misc.h"
+
+
+namespace natives
+{
+    // sort cx words starting at address si, as signed integers in ascending order
+    void memorySort( NativeContext& ctx )
+    {
+        size_t start = ctx.reg[si];
+        size_t count = ctx.reg[cx];
+        if( start + count > ctx.memory.size() )
+            Error( "Native sort out of memory bounds" );
+
+        std::span<uint16_t> words = ctx.memory.subspan( start, count );
+        std::sort( words.begin(), words.end(), []( uint16_t a, uint16_t b )
+        {
+            return static_cast<int16_t>( a ) < static_cast<int16_t>( b );
+        });
+        ctx.flags[ZRO] = ( count == 0 );
+    }
+
+    // write the signed value of ax as a null terminated string at address di, put its length in cx
+    void intToString( NativeContext& ctx )
+    {
+        char buffer[8];     // "-32768" is the longest possible string
+        int16_t value = static_cast<int16_t>( ctx.reg[ax] );
+        char* end = std::to_chars( buffer, buffer + sizeof( buffer ), value ).ptr;
+        size_t length = static_cast<size_t>( end - buffer );
+
+        size_t address = ctx.reg[di];
+        if( address + length + 1 > ctx.memory.size() )
+            Error( "Native itoa out of memory bounds" );
+
+        for( size_t i = 0; i < length; i++ )
+        {
+            ctx.memory[address + i] = static_cast<uint16_t>( buffer[i] );
+        }
+        ctx.memory[address + length] = 0;
+        ctx.reg[cx] = static_cast<uint16_t>( length );
+
+        ctx.flags[NEG] = value < 0;
+        ctx.flags[POS] = value > 0;
+        ctx.flags[ZRO] = value == 0;
+        ctx.flags[EQU] = value == 0;
+    }
+}
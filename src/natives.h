@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+#include <span>
+
+#include "basmDefinition.h"
+
+
+//  +------------------------------+
+//  |    Native (host) functions   |
+//  +------------------------------+
+
+// state handed to a native function when the guest executes 'native N'
+// registers, guest memory and flags can be read and modified directly
+struct NativeContext
+{
+    uint16_t* reg;                  // guest registers, access like ctx.reg[ax]
+    std::span<uint16_t> memory;     // whole guest address space
+    bool* flags;                    // guest CPU flags, access like ctx.flags[ZRO]
+};
+
+// slots of the built-in natives, registered by VM::initialize()
+enum NativeSlot
+{
+    NATIVE_SORT = 0,    // sort cx words starting at address si ( signed, ascending )
+    NATIVE_ITOA,        // write ax as a decimal string at address di, string length in cx
+    NATIVE_COUNT = 256  // amount of slots available
+};
+
+namespace natives
+{
+    // sort cx words starting at address si, as signed integers in ascending order
+    void memorySort( NativeContext& ctx );
+
+    // write the signed value of ax as a null terminated string at address di, put its length in cx
+    void intToString( NativeContext& ctx );
+}
@@ -0,0 +1,30 @@
+#!/bin/sh
+# run every sample program of this folder and compare what it displays with <name>.expected
+# options for bin/main are read from a first line '# args: ...', paths are relative to this folder
+# usage : tests/run.sh [ path/to/main ]
+
+MAIN=$(realpath "${1:-$(dirname "$0")/../bin/main}") || exit 1
+cd "$(dirname "$0")" || exit 1
+OUTPUT=$(mktemp)
+trap 'rm -f "$OUTPUT"' EXIT
+
+failed=0
+for program in *.basm; do
+    name=${program%.basm}
+    args=$(sed -n '1s/^# args://p' "$program")
+    # shellcheck disable=SC2086
+    "$MAIN" "$program" --output "$OUTPUT" $args > /dev/null
+    status=$?
+    if [ "$status" -ne 0 ]; then
+        echo "FAIL $name : exit status $status"
+        failed=$((failed + 1))
+    elif ! diff -u "$name.expected" "$OUTPUT" > /dev/null; then
+        echo "FAIL $name : unexpected output"
+        diff -u "$name.expected" "$OUTPUT" | tail -n +3
+        failed=$((failed + 1))
+    else
+        echo "ok   $name"
+    fi
+done
+
+[ "$failed" -eq 0 ] || { echo "$failed sample(s) failed"; exit 1; }